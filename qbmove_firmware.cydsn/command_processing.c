@@ -56,11 +56,33 @@
 
 reg8 * EEPROM_ADDR = (reg8 *) CYDEV_EE_BASE;
 
+// Sequenced frames state (see CMD_SEQ_FRAME)
+
+static CYBIT seq_active;                // Host is using sequenced frames
+static CYBIT seq_wrap;                  // Replies are wrapped in a sequenced frame
+static CYBIT seq_replied;               // Current frame has been answered
+static CYBIT seq_executed;              // seq_last is valid
+static CYBIT seq_cache_valid;           // seq_cache holds the last reply
+static uint8 seq_last;                  // Sequence number of last executed frame
+static uint8 seq_cache_len;
+static uint8 seq_cache[SEQ_CACHE_SIZE];
+
+// Pretension on stiffness, Q15 of max_stiffness (see stiffLutSetup)
+
+static uint16 stiff_lut[STIFF_LUT_SIZE];
+
+// Pages queued by memStoreMark(), user and default memory, and page write
+// started by memStoreStep()
+
+static uint16 store_pages[2];
+static CYBIT store_busy;
+
 //==============================================================================
 //                                                            RX DATA PROCESSING
 //==============================================================================
 //  This function checks for the availability of a data packet and process it:
 //      - Verify checksum;
+//      - Unwrap sequenced frames;
 //      - Process commands;
 //==============================================================================
 
@@ -74,10 +96,22 @@ void commProcess(){
 
     if (!(LCRChecksum(g_rx.buffer, g_rx.length - 1) == g_rx.buffer[g_rx.length - 1])){
         // Wrong checksum
+        if (!g_rx.broadcast)
+            sendNack(NACK_CHECKSUM);
         g_rx.ready = 0;
         return;
     }
 
+//=====================================================     sequenced frame header
+
+    if (rx_cmd == CMD_SEQ_FRAME) {
+        if (!seqFrameOpen())
+            return;
+        rx_cmd = g_rx.buffer[0];
+    }
+    else
+        seq_active = FALSE;
+
     switch(rx_cmd){
 //=====================================================     CMD_GET_MEASUREMENTS
 
@@ -105,6 +139,7 @@ void commProcess(){
 //===========================================================     CMD_SET_INPUTS
 
         case CMD_SET_INPUTS:
+        case CMD_SET_INPUTS_FF:
             cmd_set_inputs();
             break;
             
@@ -120,6 +155,24 @@ void commProcess(){
             cmd_get_velocities();
             break;
 
+//=======================================================     CMD_SET_TRAJ_POINT
+
+        case CMD_SET_TRAJ_POINT:
+            cmd_set_traj_point();
+            break;
+
+//======================================================     CMD_GET_TRAJ_STATUS
+
+        case CMD_GET_TRAJ_STATUS:
+            cmd_get_traj_status();
+            break;
+
+//=====================================================     CMD_GET_CALIB_STATUS
+
+        case CMD_GET_CALIB_STATUS:
+            cmd_get_calib_status();
+            break;
+
 //=============================================================     CMD_ACTIVATE
         case CMD_ACTIVATE:
             cmd_activate();
@@ -214,14 +267,172 @@ void commProcess(){
 
 //============================================================     CMD_CALIBRATE
         case CMD_CALIBRATE:
-            calibration_flag = START;
-            sendAcknowledgment(ACK_OK);
+            if ((calibration_flag == STOP) && (tune_status != TUNE_RUNNING) && (g_fra.status != FRA_RUNNING)) {
+                traj_flush();
+                calibration_flag = START;
+                sendAcknowledgment(ACK_OK);
+            }
+            else
+                sendAcknowledgment(ACK_ERROR);
+            break;
+
+//=======================================================     CMD_FRICTION_IDENT
+        case CMD_FRICTION_IDENT:
+            traj_flush();
+            if (friction_ident_start())
+                sendAcknowledgment(ACK_OK);
+            else
+                sendAcknowledgment(ACK_ERROR);
+            break;
+
+//============================================================     CMD_AUTOTUNE
+        case CMD_AUTOTUNE:
+            traj_flush();
+            if (autotune_start(g_rx.buffer[1]))
+                sendAcknowledgment(ACK_OK);
+            else
+                sendAcknowledgment(ACK_ERROR);
+            break;
+
+//========================================================     CMD_GET_AUTOTUNE
+        case CMD_GET_AUTOTUNE:
+            cmd_get_autotune();
+            break;
+
+//===========================================================     CMD_FRA_START
+        case CMD_FRA_START:
+            // Command, input, output, points, f_start, f_stop, amp, checksum
+            if (g_rx.length < 11) {
+                if (seq_wrap)
+                    seqFrameReject(NACK_LENGTH);
+                else
+                    sendAcknowledgment(ACK_ERROR);
+                break;
+            }
+            traj_flush();
+            if (fra_start(g_rx.buffer[1], g_rx.buffer[2], g_rx.buffer[3],
+                    *((uint16 *) &g_rx.buffer[4]), *((uint16 *) &g_rx.buffer[6]),
+                    *((int16 *) &g_rx.buffer[8])))
+                sendAcknowledgment(ACK_OK);
+            else
+                sendAcknowledgment(ACK_ERROR);
+            break;
+
+//=============================================================     CMD_GET_FRA
+        case CMD_GET_FRA:
+            cmd_get_fra();
             break;
 
 //=========================================================== ALL OTHER COMMANDS
         default:
+            // Unknown inner command, not executed
+            seqFrameReject(NACK_COMMAND);
             break;
     }
+
+    seqFrameClose(rx_cmd);
+}
+
+//==============================================================================
+//                                                              SEQUENCED FRAMES
+//==============================================================================
+//  seqFrameOpen() is called on a valid CMD_SEQ_FRAME packet. It answers
+//  retransmissions from the reply cache, otherwise it strips the sequence
+//  header from g_rx and returns TRUE so that the inner command is executed.
+//  seqFrameClose() acknowledges inner commands which do not send any reply.
+//  Inner commands which are not executed call seqFrameReject() instead,
+//  unknown ones are rejected by commProcess() with NACK_COMMAND.
+//==============================================================================
+
+uint8 seqFrameOpen(void) {
+
+    uint8 CYDATA seq;
+
+    // Header + seq + command + checksum
+    if (g_rx.length < 4) {
+        seq_active = TRUE;
+        if (!g_rx.broadcast)
+            sendNack(NACK_LENGTH);
+        return FALSE;
+    }
+
+    seq = g_rx.buffer[1];
+    seq_active = TRUE;
+
+    // Retransmission: do not execute the command again
+    if (seq_executed && seq == seq_last && seq_cache_valid) {
+        if (seq_cache_len) {
+            seq_wrap = TRUE;
+            commWrite(seq_cache, seq_cache_len);
+            seq_wrap = FALSE;
+        }
+        return FALSE;
+    }
+
+    seq_last        = seq;
+    seq_executed    = TRUE;
+    seq_cache_valid = FALSE;
+    seq_replied     = FALSE;
+    seq_wrap        = TRUE;
+
+    // Move the inner command to the head of the buffer
+    g_rx.length -= 2;
+    memmove(g_rx.buffer, g_rx.buffer + 2, g_rx.length);
+
+    return TRUE;
+}
+
+void seqFrameClose(const uint8 rx_cmd) {
+
+    if (!seq_wrap)
+        return;
+
+    if (!seq_replied) {
+        if (g_rx.broadcast) {
+            // Nobody answers a broadcast, remember it was executed
+            seq_cache_len   = 0;
+            seq_cache_valid = TRUE;
+        }
+        else if (rx_cmd != CMD_GET_INFO)    // info string is sent as it is
+            sendAcknowledgment(ACK_OK);
+    }
+
+    seq_wrap = FALSE;
+}
+
+// Answers the inner command being executed with a nack in place of the
+// acknowledgment of seqFrameClose(). Plain frames get no reply.
+
+void seqFrameReject(const uint8 reason) {
+
+    if (!seq_wrap)
+        return;
+
+    seq_wrap = FALSE;
+    if (!g_rx.broadcast)
+        sendNack(reason);
+}
+
+//==============================================================================
+//                                                                 NACK FUNCTION
+//==============================================================================
+
+void sendNack(const uint8 reason) {
+
+    // Packet: header + last seq + reason + crc
+
+    uint8 CYDATA packet_data[4];
+
+    // Nacks are meaningful only to hosts using sequenced frames
+    if (!seq_active)
+        return;
+
+    packet_data[0] = CMD_SEQ_NACK;
+    packet_data[1] = seq_last;
+    packet_data[2] = reason;
+    packet_data[3] = LCRChecksum(packet_data, 3);
+
+    commWrite(packet_data, 4);
 }
 
 //==============================================================================
@@ -229,7 +440,7 @@ void commProcess(){
 //==============================================================================
 
 void infoGet(uint16 info_type){
-    unsigned char packet_string[1100];
+    unsigned char packet_string[INFO_STRING_SIZE];
 
 //======================================     choose info type and prepare string
 
@@ -254,8 +465,6 @@ void setZeros()
     for(i = 0; i < NUM_OF_SENSORS; ++i) {
         g_mem.m_off[i] = *((int16 *) &g_rx.buffer[1 + i * 2]);
         g_mem.m_off[i] = g_mem.m_off[i] << g_mem.res[i];
-
-        g_meas.rot[i] = 0;
     }
     reset_last_value_flag = 1;
 
@@ -268,9 +477,10 @@ void setZeros()
 
 void get_param_list(uint16 index)
 {
-    //Package to be sent variables
-    uint8 packet_data[1201] = "";
-    uint16 packet_lenght = 1201;
+    //Package to be sent variables, static so that its 1.6 kB stay out of the
+    //locals overlay of the scheduler call tree commProcess() is reached from
+    static uint8 packet_data[PARAM_LIST_LENGTH];
+    uint16 packet_lenght = PARAM_LIST_LENGTH;
 
     //Auxiliary variables
     uint16 CYDATA i;
@@ -291,6 +501,15 @@ void get_param_list(uint16 index)
     char pos_lim_str[29]        = "11 - Pos. limits [inf, sup]:";
     char max_step_str[27]       = "12 - Max steps [neg, pos]:";
     char curr_limit_str[20]     = "13 - Current limit:";
+    char comm_dl_str[25]        = "14 - Comm. deadline [%]:";
+    char rates_str[34]          = "15 - Rates [kHz, pos. divider]:";
+    char vel_est_str[42]        = "16 - Vel. estimator (0 diff, 1 observer):";
+    char filter_str[NUM_OF_FILTER_GROUPS][36] = {   "17 - Current filter [type, coefs]:",
+                                                    "18 - Cascade filter [type, coefs]:",
+                                                    "19 - Velocity filter [type, coefs]:"};
+    char friction_str[33]       = "20 - Dead, friction [C+,C-,V]x2:";
+    char int_limit_str[34]      = "21 - Integral limits [pos, curr]:";
+    char ff_str[29]             = "22 - Feedforward [vel, acc]:";
 
     //Parameters menus
     char input_mode_menu[52] = "0 -> Usb\n1 -> Shaft's position controls the motors\n";
@@ -308,11 +527,22 @@ void get_param_list(uint16 index)
 
     uint8 CYDATA pos_lim_str_len = strlen(pos_lim_str);
     uint8 CYDATA curr_limit_str_len = strlen(curr_limit_str);
+    uint8 CYDATA comm_dl_str_len = strlen(comm_dl_str);
+    uint8 CYDATA rates_str_len = strlen(rates_str);
+    uint8 CYDATA vel_est_str_len = strlen(vel_est_str);
+    uint8 CYDATA filter_str_len;
+    uint8 CYDATA friction_str_len = strlen(friction_str);
+    uint8 CYDATA int_limit_str_len = strlen(int_limit_str);
+    uint8 CYDATA ff_str_len = strlen(ff_str);
+    uint8 CYDATA j;
+
+    struct st_filter filter_cfg;
 
     uint8 CYDATA input_mode_menu_len = strlen(input_mode_menu);
     uint8 CYDATA control_mode_menu_len = strlen(control_mode_menu);
     uint8 CYDATA yes_no_menu_len = strlen(input_mode_menu);
 
+    memset(packet_data, 0, PARAM_LIST_LENGTH);
     packet_data[0] = CMD_GET_PARAM_LIST;
     packet_data[1] = NUM_OF_PARAMS;
 
@@ -458,8 +688,8 @@ void get_param_list(uint16 index)
             packet_data[403] = 3;
             for(i = 0; i < NUM_OF_SENSORS; i++)
                 *((float *) ( packet_data + 404 + (i * 4) )) = c_mem.m_mult[i];
-            for(i = 0; i < strlen(mult_str); i++)
-                packet_data[416 + i] = mult_str[i];
+            for(i = mult_str_len; i != 0; i--)
+                packet_data[416 + mult_str_len - i] = mult_str[mult_str_len - i];
 
             /*-----------POS LIMIT FLAG-----------*/
             
@@ -507,16 +737,91 @@ void get_param_list(uint16 index)
             for(i = curr_limit_str_len; i != 0; i--)
                 packet_data[606 + curr_limit_str_len - i] = curr_limit_str[curr_limit_str_len - i];
 
+            /*------------COMM DEADLINE-----------*/
+
+            packet_data[652] = TYPE_UINT8;
+            packet_data[653] = 1;
+            packet_data[654] = c_mem.comm_deadline;
+            for(i = comm_dl_str_len; i != 0; i--)
+                packet_data[655 + comm_dl_str_len - i] = comm_dl_str[comm_dl_str_len - i];
+
+            /*---------------RATES----------------*/
+
+            packet_data[702] = TYPE_UINT8;
+            packet_data[703] = 2;
+            packet_data[704] = c_mem.base_rate;
+            packet_data[705] = c_mem.pos_div;
+            for(i = rates_str_len; i != 0; i--)
+                packet_data[706 + rates_str_len - i] = rates_str[rates_str_len - i];
+
+            /*---------VELOCITY ESTIMATOR---------*/
+
+            packet_data[752] = TYPE_UINT8;
+            packet_data[753] = 1;
+            packet_data[754] = c_mem.vel_estimator;
+            for(i = vel_est_str_len; i != 0; i--)
+                packet_data[755 + vel_est_str_len - i] = vel_est_str[vel_est_str_len - i];
+
+            /*--------------FILTERS---------------*/
+
+            for (j = 0; j < NUM_OF_FILTER_GROUPS; j++) {
+                packet_data[802 + j * PARAM_BYTE_SLOT] = TYPE_INT16;
+                packet_data[803 + j * PARAM_BYTE_SLOT] = 6;
+                *((int16 *)(packet_data + 804 + j * PARAM_BYTE_SLOT)) = c_mem.filter[j].type;
+                for (i = 0; i < 5; i++)
+                    *((int16 *)(packet_data + 806 + j * PARAM_BYTE_SLOT + (i * 2))) = c_mem.filter[j].coef[i];
+                filter_str_len = strlen(filter_str[j]);
+                for(i = filter_str_len; i != 0; i--)
+                    packet_data[816 + j * PARAM_BYTE_SLOT + filter_str_len - i] = filter_str[j][filter_str_len - i];
+            }
+
+            /*--------------FRICTION--------------*/
+
+            packet_data[952] = TYPE_INT16;
+            packet_data[953] = 7;
+            *((int16 *)(packet_data + 954)) = c_mem.pwm_dead;
+            for (j = 0; j < NUM_OF_MOTORS; j++) {
+                *((int16 *)(packet_data + 956 + (j * 6))) = c_mem.fric_coul[j][0];
+                *((int16 *)(packet_data + 958 + (j * 6))) = c_mem.fric_coul[j][1];
+                *((int16 *)(packet_data + 960 + (j * 6))) = c_mem.fric_visc[j];
+            }
+            for(i = friction_str_len; i != 0; i--)
+                packet_data[968 + friction_str_len - i] = friction_str[friction_str_len - i];
+
+            /*-----------INTEGRAL LIMITS-----------*/
+
+            packet_data[1002] = TYPE_INT32;
+            packet_data[1003] = 2;
+            *((int32 *)(packet_data + 1004)) = c_mem.pos_int_limit;
+            *((int32 *)(packet_data + 1008)) = c_mem.curr_int_limit;
+            for(i = int_limit_str_len; i != 0; i--)
+                packet_data[1012 + int_limit_str_len - i] = int_limit_str[int_limit_str_len - i];
+
+            /*-------------FEEDFORWARD------------*/
+
+            packet_data[1052] = TYPE_FLOAT;
+            packet_data[1053] = 2;
+            if(c_mem.control_mode != CURR_AND_POS_CONTROL && c_mem.control_mode != DEFL_CURRENT_CONTROL) {
+                *((float *) (packet_data + 1054)) = (float) c_mem.k_vff / 65536;
+                *((float *) (packet_data + 1058)) = (float) c_mem.k_aff / 65536;
+            }
+            else {
+                *((float *) (packet_data + 1054)) = (float) c_mem.k_vff_dl / 65536;
+                *((float *) (packet_data + 1058)) = (float) c_mem.k_aff_dl / 65536;
+            }
+            for(i = ff_str_len; i != 0; i--)
+                packet_data[1062 + ff_str_len - i] = ff_str[ff_str_len - i];
+
             /*------------PARAMETERS MENU-----------*/
 
             for(i = input_mode_menu_len; i != 0; i--)
-                packet_data[652 + input_mode_menu_len - i] = input_mode_menu[input_mode_menu_len - i];
+                packet_data[PARAM_MENU_OFFSET + input_mode_menu_len - i] = input_mode_menu[input_mode_menu_len - i];
 
             for(i = control_mode_menu_len; i != 0; i--)
-                packet_data[802 + control_mode_menu_len - i] = control_mode_menu[control_mode_menu_len - i];
+                packet_data[PARAM_MENU_OFFSET + PARAM_MENU_SLOT + control_mode_menu_len - i] = control_mode_menu[control_mode_menu_len - i];
 
             for(i = yes_no_menu_len; i!= 0; i--)
-                packet_data[952 + yes_no_menu_len - i] = yes_no_menu[yes_no_menu_len - i];
+                packet_data[PARAM_MENU_OFFSET + 2 * PARAM_MENU_SLOT + yes_no_menu_len - i] = yes_no_menu[yes_no_menu_len - i];
 
             packet_data[packet_lenght - 1] = LCRChecksum(packet_data,packet_lenght - 1);
             commWrite(packet_data, packet_lenght);
@@ -582,8 +887,6 @@ void get_param_list(uint16 index)
             for(i = 0; i < NUM_OF_SENSORS; ++i) {
                 g_mem.m_off[i] = *((int16 *) &g_rx.buffer[3 + i * 2]);
                 g_mem.m_off[i] = g_mem.m_off[i] << g_mem.res[i];
-
-                g_meas.rot[i] = 0;
             }
             reset_last_value_flag = 1;
         break;
@@ -625,6 +928,94 @@ void get_param_list(uint16 index)
         case 13:        //Current limit - int16
             g_mem.current_limit = *((int16*) &g_rx.buffer[3]);
         break;
+
+//========================================================     set_comm_deadline
+        case 14:        //Comm. deadline - uint8
+            if ((g_rx.buffer[3] == 0) || (g_rx.buffer[3] > 100)) {
+                seqFrameReject(NACK_VALUE);
+                return;
+            }
+            g_mem.comm_deadline = g_rx.buffer[3];
+        break;
+
+//=================================================================     set_rates
+        case 15:        //Main frequency and position loop divider - uint8[2]
+            if (!IS_POWER_OF_2(g_rx.buffer[3]) || (g_rx.buffer[3] > MAX_BASE_RATE) ||
+                !IS_POWER_OF_2(g_rx.buffer[4]) || (g_rx.buffer[4] > MAX_POS_DIV)) {
+                seqFrameReject(NACK_VALUE);
+                return;
+            }
+            g_mem.base_rate = g_rx.buffer[3];
+            g_mem.pos_div = g_rx.buffer[4];
+        break;
+
+//=====================================================     set_vel_estimator
+        case 16:        //Velocity estimator - uint8
+            if (g_rx.buffer[3] > VEL_EST_OBSERVER) {
+                seqFrameReject(NACK_VALUE);
+                return;
+            }
+            g_mem.vel_estimator = g_rx.buffer[3];
+        break;
+
+//===============================================================     set_filters
+        case 17:        //Current filter - int16[6]
+        case 18:        //Current loop filter - int16[6]
+        case 19:        //Velocity filter - int16[6]
+            filter_cfg.type = *((int16 *) &g_rx.buffer[3]);
+            for (i = 0; i < 5; i++)
+                filter_cfg.coef[i] = *((int16 *) &g_rx.buffer[5 + (i * 2)]);
+            if (!filterValid(&filter_cfg)) {
+                seqFrameReject(NACK_VALUE);
+                return;
+            }
+            memcpy(&g_mem.filter[index - 17], &filter_cfg, sizeof(filter_cfg));
+        break;
+
+//==============================================================     set_friction
+        case 20:        //Deadband and friction - int16[7]
+            for (j = 0; j < 7; j++) {
+                aux_int = *((int16 *) &g_rx.buffer[3 + (j * 2)]);
+                // viscous ones (3, 6) are only non negative
+                if ((aux_int < 0) || ((j != 3) && (j != 6) && (aux_int > ((int32)PWM_MAX_VALUE << PWM_OUT_SHIFT)))) {
+                    seqFrameReject(NACK_VALUE);
+                    return;
+                }
+            }
+            g_mem.pwm_dead = *((int16 *) &g_rx.buffer[3]);
+            for (j = 0; j < NUM_OF_MOTORS; j++) {
+                g_mem.fric_coul[j][0] = *((int16 *) &g_rx.buffer[5 + (j * 6)]);
+                g_mem.fric_coul[j][1] = *((int16 *) &g_rx.buffer[7 + (j * 6)]);
+                g_mem.fric_visc[j] = *((int16 *) &g_rx.buffer[9 + (j * 6)]);
+            }
+        break;
+
+//=========================================================     set_int_limits
+        case 21:        //Integral limits - int32[2]
+            if ((*((int32 *) &g_rx.buffer[3]) <= 0) || (*((int32 *) &g_rx.buffer[3 + 4]) <= 0)) {
+                seqFrameReject(NACK_VALUE);
+                return;
+            }
+            g_mem.pos_int_limit = *((int32 *) &g_rx.buffer[3]);
+            g_mem.curr_int_limit = *((int32 *) &g_rx.buffer[3 + 4]);
+        break;
+
+//============================================================     set_feedforward
+        case 22:        //Feedforward - float[2]
+            for (j = 0; j < 2; j++)
+                if (!FF_GAIN_VALID(*((float *) &g_rx.buffer[3 + (j * 4)]) * 65536)) {
+                    seqFrameReject(NACK_VALUE);
+                    return;
+                }
+            if(c_mem.control_mode != CURR_AND_POS_CONTROL && c_mem.control_mode != DEFL_CURRENT_CONTROL) {
+                g_mem.k_vff = *((float *) &g_rx.buffer[3]) * 65536;
+                g_mem.k_aff = *((float *) &g_rx.buffer[3 + 4]) * 65536;
+            }
+            else {
+                g_mem.k_vff_dl = *((float *) &g_rx.buffer[3]) * 65536;
+                g_mem.k_aff_dl = *((float *) &g_rx.buffer[3 + 4]) * 65536;
+            }
+        break;
     }
 }
 
@@ -632,35 +1023,49 @@ void get_param_list(uint16 index)
 //                                                           PREPARE DEVICE INFO
 //==============================================================================
 
+// Append to the info string while it fits in INFO_STRING_SIZE, the rest is
+// dropped
+
+static uint16 info_len;
+
+static void infoAppend(unsigned char *info_string, const unsigned char *str) {
+
+    while (*str && (info_len < INFO_STRING_SIZE - 1))
+        info_string[info_len++] = *str++;
+
+    info_string[info_len] = '\0';
+}
+
 void infoPrepare(unsigned char *info_string)
 {
     int CYDATA i;
 
     unsigned char str[50];
     
-    strcpy(info_string, "");
-    strcat(info_string, "\r\n");
-    strcat(info_string, "Firmware version: ");
-    strcat(info_string, VERSION);
-    strcat(info_string, ".\r\n\r\n");
-
-    strcat(info_string,"DEVICE INFO\r\n");
+    info_len = 0;
+    info_string[0] = '\0';
+    infoAppend(info_string, "\r\n");
+    infoAppend(info_string, "Firmware version: ");
+    infoAppend(info_string, VERSION);
+    infoAppend(info_string, ".\r\n\r\n");
+
+    infoAppend(info_string, "DEVICE INFO\r\n");
     sprintf(str,"ID: %d\r\n",(int) c_mem.id);
-    strcat(info_string,str);
+    infoAppend(info_string, str);
     sprintf(str,"Number of sensors: %d\r\n",(int) NUM_OF_SENSORS);
-    strcat(info_string,str);
+    infoAppend(info_string, str);
     sprintf(str,"PWM Limit: %d\r\n",(int) dev_pwm_limit);
-    strcat(info_string,str);
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
 
-    strcat(info_string, "MOTOR INFO\r\n");
-    strcat(info_string, "Motor references: ");
+    infoAppend(info_string, "MOTOR INFO\r\n");
+    infoAppend(info_string, "Motor references: ");
     
     for (i = 0; i < NUM_OF_MOTORS; i++) {
         sprintf(str, "%d ", (int)(g_refOld.pos[i] >> c_mem.res[i]));
-        strcat(info_string,str);
+        infoAppend(info_string, str);
     }
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, "\r\n");
 
     sprintf(str, "Motor enabled: ");
     
@@ -669,160 +1074,185 @@ void infoPrepare(unsigned char *info_string)
     } else {
         strcat(str,"NO\r\n");
     }
-    strcat(info_string, str);
+    infoAppend(info_string, str);
 
 
-    strcat(info_string,"\r\nMEASUREMENTS INFO\r\n");
-    strcat(info_string, "Sensor value:\r\n");
+    infoAppend(info_string, "\r\nMEASUREMENTS INFO\r\n");
+    infoAppend(info_string, "Sensor value:\r\n");
     for (i = 0; i < NUM_OF_SENSORS; i++) {
         sprintf(str,"%d -> %d", i+1,
             (int)(g_measOld.pos[i] >> c_mem.res[i]));
-        strcat(info_string, str);
-        strcat(info_string, "\r\n");
+        infoAppend(info_string, str);
+        infoAppend(info_string, "\r\n");
     }
     sprintf(str,"Voltage (mV): %ld", (int32) dev_tension );
-    strcat(info_string, str);
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
 
     sprintf(str,"Current 1 (mA): %ld", (int32) g_measOld.curr[0] );
-    strcat(info_string, str);
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
 
     sprintf(str,"Current 2 (mA): %ld", (int32) g_measOld.curr[1] );
-    strcat(info_string, str);
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
 
 
-    strcat(info_string, "\r\nDEVICE PARAMETERS\r\n");
+    infoAppend(info_string, "\r\nDEVICE PARAMETERS\r\n");
 
-    strcat(info_string, "PID Controller:\r\n");
+    infoAppend(info_string, "PID Controller:\r\n");
     if(c_mem.control_mode != CURR_AND_POS_CONTROL) {
         sprintf(str,"P -> %f\r\n", ((double) c_mem.k_p / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"I -> %f\r\n", ((double) c_mem.k_i / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"D -> %f\r\n", ((double) c_mem.k_d / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
     }
     else {
         sprintf(str,"P -> %f\r\n", ((double) c_mem.k_p_dl / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"I -> %f\r\n", ((double) c_mem.k_i_dl / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"D -> %f\r\n", ((double) c_mem.k_d_dl / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
     }
 
-    strcat(info_string, "Current PID Controller:\r\n");
+    infoAppend(info_string, "Current PID Controller:\r\n");
     if(c_mem.control_mode != CURR_AND_POS_CONTROL) {
         sprintf(str,"P -> %f\r\n", ((double) c_mem.k_p_c / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"I -> %f\r\n", ((double) c_mem.k_i_c / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"D -> %f\r\n", ((double) c_mem.k_d_c / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
     }
     else {
         sprintf(str,"P -> %f\r\n", ((double) c_mem.k_p_c_dl / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"I -> %f\r\n", ((double) c_mem.k_i_c_dl / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
         sprintf(str,"D -> %f\r\n", ((double) c_mem.k_d_c_dl / 65536));
-        strcat(info_string, str);
+        infoAppend(info_string, str);
     }
 
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, "\r\n");
 
     if (c_mem.activ == 0x03) {
-        strcat(info_string, "Startup activation: YES\r\n");
+        infoAppend(info_string, "Startup activation: YES\r\n");
     } else {
-        strcat(info_string, "Startup activation: NO\r\n");
+        infoAppend(info_string, "Startup activation: NO\r\n");
     }
 
     switch(c_mem.input_mode) {
         case 0:
-            strcat(info_string, "Input mode: USB\r\n");
+            infoAppend(info_string, "Input mode: USB\r\n");
         break;
         case 1:
-            strcat(info_string, "Input mode: Sensor 3\r\n");
+            infoAppend(info_string, "Input mode: Sensor 3\r\n");
         break;
     }
     
-    strcat(info_string, "Control Mode: ");
+    infoAppend(info_string, "Control Mode: ");
     switch(c_mem.control_mode) {
         case CONTROL_ANGLE:
-            strcat(info_string, "Position\r\n");
+            infoAppend(info_string, "Position\r\n");
         break;
         case CONTROL_PWM:
-            strcat(info_string, "PWM\r\n");
+            infoAppend(info_string, "PWM\r\n");
             break;
         case CONTROL_CURRENT:
-            strcat(info_string, "Current\r\n");
+            infoAppend(info_string, "Current\r\n");
             break;
         case CURR_AND_POS_CONTROL:
-            strcat(info_string, "Position and current\r\n");
+            infoAppend(info_string, "Position and current\r\n");
             break;
         case DEFLECTION_CONTROL: 
-            strcat(info_string, "Deflection\r\n");
+            infoAppend(info_string, "Deflection\r\n");
             break;
         case DEFL_CURRENT_CONTROL:
-            strcat(info_string, "Deflection and current\r\n");
+            infoAppend(info_string, "Deflection and current\r\n");
             break;
     }
 
-    strcat(info_string, "Sensor resolution:\r\n");
+    infoAppend(info_string, "Sensor resolution:\r\n");
     for(i = 0; i < NUM_OF_SENSORS; ++i)
     {
         sprintf(str,"%d -> %d", (int) (i + 1),
             (int) c_mem.res[i]);
-        strcat(info_string, str);
-        strcat(info_string,"\r\n");
+        infoAppend(info_string, str);
+        infoAppend(info_string, "\r\n");
     }
 
 
-    strcat(info_string, "Measurement Offset:\r\n");
+    infoAppend(info_string, "Measurement Offset:\r\n");
     for(i = 0; i < NUM_OF_SENSORS; ++i)
     {
         sprintf(str,"%d -> %ld", (int) (i + 1),
             (int32) c_mem.m_off[i] >> c_mem.res[i]);
-        strcat(info_string, str);
-        strcat(info_string,"\r\n");
+        infoAppend(info_string, str);
+        infoAppend(info_string, "\r\n");
     }
 
-    strcat(info_string, "Measurement Multiplier:\r\n");
+    infoAppend(info_string, "Measurement Multiplier:\r\n");
     for(i = 0; i < NUM_OF_SENSORS; ++i)
     {
         sprintf(str,"%d -> %f", (int)(i + 1),
             (double) c_mem.m_mult[i]);
-        strcat(info_string, str);
-        strcat(info_string,"\r\n");
+        infoAppend(info_string, str);
+        infoAppend(info_string, "\r\n");
     }
 
     sprintf(str, "Position limit active: %d", (int)g_mem.pos_lim_flag);
-    strcat(info_string, str);
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
 
     for (i = 0; i < NUM_OF_MOTORS; i++) {
         sprintf(str, "Position limit motor %d: inf -> %ld  ", (int)(i + 1),
                 (int32)g_mem.pos_lim_inf[i] >> g_mem.res[i]);
-        strcat(info_string, str);
+        infoAppend(info_string, str);
 
         sprintf(str, "sup -> %ld\r\n",
                 (int32)g_mem.pos_lim_sup[i] >> g_mem.res[i]);
-        strcat(info_string, str);
+        infoAppend(info_string, str);
     }
 
     sprintf(str, "Max stiffness: %d", (int)g_mem.max_stiffness >> g_mem.res[0]);
-    strcat(info_string, str);
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
 
     sprintf(str, "Current limit: %d", (int)g_mem.current_limit);
-    strcat(info_string, str);
-    strcat(info_string,"\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
+
+    sprintf(str, "Comm. deadline: %d%% of %ld", (int)c_mem.comm_deadline, (uint32)timer_cycle);
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
+
+    sprintf(str, "Main frequency: %d kHz", (int)c_mem.base_rate);
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
+
+    sprintf(str, "Position loop divider: %d", (int)c_mem.pos_div);
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
+
+    infoAppend(info_string, "Velocity estimator: ");
+    if (c_mem.vel_estimator == VEL_EST_OBSERVER)
+        infoAppend(info_string, "Tracking observer\r\n");
+    else
+        infoAppend(info_string, "Filtered difference\r\n");
     
     sprintf(str, "debug: %ld", (uint32) timer_value0 - (uint32) timer_value);
-    strcat(info_string, str);
-    strcat(info_string, "\r\n");
+    infoAppend(info_string, str);
+    infoAppend(info_string, "\r\n");
+
+    infoAppend(info_string, "Tasks [exec, overruns, misses]:\r\n");
+    for (i = 0; i < NUM_OF_TASKS; i++) {
+        sprintf(str, "%d -> %ld %u %u\r\n", i, (uint32)tasks[i].exec,
+            tasks[i].overruns, tasks[i].misses);
+        infoAppend(info_string, str);
+    }
 }
 
 //==============================================================================
@@ -832,21 +1262,47 @@ void infoPrepare(unsigned char *info_string)
 void commWrite_old_id(uint8 *packet_data, uint16 packet_lenght, uint8 old_id)
 {
     uint16 CYDATA index;    // iterator
+    uint8 CYDATA checksum;
 
     // frame - start
     UART_RS485_PutChar(':');
     UART_RS485_PutChar(':');
     // frame - ID
-    //if(old_id)
-        UART_RS485_PutChar(old_id);
-    //else
-        //UART_RS485_PutChar(g_mem.id);
-        
-    // frame - length
-    UART_RS485_PutChar((uint8)packet_lenght);
-    // frame - packet data
-    for(index = 0; index < packet_lenght; ++index) {
-        UART_RS485_PutChar(packet_data[index]);
+    UART_RS485_PutChar(old_id);
+
+    if (seq_wrap) {
+        // frame - length
+        UART_RS485_PutChar((uint8)(packet_lenght + 3));
+        // frame - sequence header
+        UART_RS485_PutChar(CMD_SEQ_FRAME);
+        UART_RS485_PutChar(seq_last);
+        checksum = CMD_SEQ_FRAME ^ seq_last;
+        // frame - packet data
+        for(index = 0; index < packet_lenght; ++index) {
+            UART_RS485_PutChar(packet_data[index]);
+            checksum ^= packet_data[index];
+        }
+        UART_RS485_PutChar(checksum);
+
+        // keep the reply for retransmissions
+        if (packet_data != seq_cache) {
+            if (packet_lenght <= SEQ_CACHE_SIZE) {
+                memcpy(seq_cache, packet_data, packet_lenght);
+                seq_cache_len   = packet_lenght;
+                seq_cache_valid = TRUE;
+            }
+            else
+                seq_cache_valid = FALSE;
+        }
+        seq_replied = TRUE;
+    }
+    else {
+        // frame - length
+        UART_RS485_PutChar((uint8)packet_lenght);
+        // frame - packet data
+        for(index = 0; index < packet_lenght; ++index) {
+            UART_RS485_PutChar(packet_data[index]);
+        }
     }
 
     index = 0;
@@ -859,28 +1315,7 @@ void commWrite_old_id(uint8 *packet_data, uint16 packet_lenght, uint8 old_id)
 
 void commWrite(uint8 *packet_data,const uint16 packet_lenght)
 {
-    uint16 CYDATA index;
-
-    // frame - start
-    UART_RS485_PutChar(':');
-    UART_RS485_PutChar(':');
-    
-    // frame - ID
-    UART_RS485_PutChar(g_mem.id);
-    
-    // frame - length
-    UART_RS485_PutChar((uint8)packet_lenght);
-    
-    // frame - packet data
-    for(index = 0; index < packet_lenght; ++index)
-        UART_RS485_PutChar(packet_data[index]);
-    
-    index = 0;
-
-    while(!(UART_RS485_ReadTxStatus() & UART_RS485_TX_STS_COMPLETE) && index++ <= 1000){}
-
-    RS485_CTS_Write(1);
-    RS485_CTS_Write(0);
+    commWrite_old_id(packet_data, packet_lenght, g_mem.id);
 }
 
 //==============================================================================
@@ -920,6 +1355,10 @@ uint8 memStore(int displacement) {
     PWM_MOTORS_WriteCompare1(0);
     PWM_MOTORS_WriteCompare2(0);
 
+    // Page started by memStoreStep() still being written
+    if (store_busy)
+        while (EEPROM_Query() == CYRET_STARTED);
+
     // Retrieve temperature for better writing performance
     EEPROM_UpdateTemperature();
 
@@ -937,9 +1376,112 @@ uint8 memStore(int displacement) {
 
     memcpy( &g_mem, &c_mem, sizeof(g_mem) );
 
+    control_setup();
+    stiffLutSetup();
+
     return ret_val;
 }
 
+//==============================================================================
+//                                                          STORE MEMORY, PAGES
+//==============================================================================
+/**
+* These functions store a part of c_mem in both the user and the default
+* memory, one page at a time, so that the control loop is not held for the
+* whole st_mem. memStoreMark() queues the pages of a field. memStoreStep()
+* starts the write of a page and returns, next calls wait for it to complete
+* before starting the following one.
+**/
+
+void memStoreMark(const uint8 *field, const uint8 size) {
+
+    uint8 CYDATA page = (field - &c_mem.flag) >> 4;
+    uint8 CYDATA last = (field + size - 1 - &c_mem.flag) >> 4;
+
+    // Retrieve temperature for better writing performance
+    EEPROM_UpdateTemperature();
+
+    for (; page <= last; page++) {
+        store_pages[0] |= (uint16)1 << page;
+        store_pages[1] |= (uint16)1 << page;
+    }
+}
+
+uint8 memStoreStep(void) {
+
+    uint8 CYDATA area;
+    uint8 CYDATA page;
+
+    // Previous page
+    if (store_busy) {
+        switch(EEPROM_Query()) {
+            case CYRET_STARTED:
+                return STORE_PENDING;
+
+            case CYRET_SUCCESS:
+                store_busy = FALSE;
+                break;
+
+            default:
+                store_busy = FALSE;
+                store_pages[0] = 0;
+                store_pages[1] = 0;
+                return STORE_FAILED;
+        }
+    }
+
+    for (area = 0; area < 2; area++) {
+        if (!store_pages[area])
+            continue;
+
+        for (page = 0; !(store_pages[area] & ((uint16)1 << page)); page++);
+        store_pages[area] &= ~((uint16)1 << page);
+
+        if (EEPROM_StartWrite(&c_mem.flag + 16 * page, page + (area ? DEFAULT_EEPROM_DISPLACEMENT : 0)) != CYRET_SUCCESS) {
+            store_pages[0] = 0;
+            store_pages[1] = 0;
+            return STORE_FAILED;
+        }
+
+        store_busy = TRUE;
+        return STORE_PENDING;
+    }
+
+    return STORE_DONE;
+}
+
+
+//==============================================================================
+//                                                                MIGRATE MEMORY
+//==============================================================================
+/**
+* This function copies the default memory of the layout before mem_version,
+* the fields up to max_step_pos, from OLD_EEPROM_DISPLACEMENT to
+* DEFAULT_EEPROM_DISPLACEMENT. It must run before the user memory is stored,
+* as the larger st_mem overwrites the old default pages. Nothing is copied if
+* the old default memory was never written, if the default memory has already
+* been stored with the current layout, or if the pages are already there.
+**/
+
+static void memMigrate(void) {
+
+    uint8 CYDATA page;
+    uint8 CYDATA old_size = &g_mem.mem_version - &g_mem.flag;
+    uint8 buf[16];
+
+    if ((EEPROM_ADDR[OLD_EEPROM_DISPLACEMENT * 16] == FALSE) ||
+        (EEPROM_ADDR[DEFAULT_EEPROM_DISPLACEMENT * 16 + old_size] == MEM_VERSION))
+        return;
+
+    // Retrieve temperature for better writing performance
+    EEPROM_UpdateTemperature();
+
+    for (page = 0; page < ((old_size + 15) >> 4); page++) {
+        memcpy(buf, (uint8 *)&EEPROM_ADDR[(OLD_EEPROM_DISPLACEMENT + page) * 16], 16);
+        if (memcmp(buf, (uint8 *)&EEPROM_ADDR[(DEFAULT_EEPROM_DISPLACEMENT + page) * 16], 16))
+            EEPROM_Write(buf, DEFAULT_EEPROM_DISPLACEMENT + page);
+    }
+}
 
 //==============================================================================
 //                                                                 RECALL MEMORY
@@ -954,14 +1496,21 @@ void memRecall(void) {
 
     for (i = 0; i < sizeof(g_mem); i++) 
         ((reg8 *) &g_mem.flag)[i] = EEPROM_ADDR[i];
+
+    // Written with the layout before mem_version, which kept the default
+    // memory at OLD_EEPROM_DISPLACEMENT
+    if (g_mem.mem_version != MEM_VERSION)
+        memMigrate();
    
+    memCheck();
 
     //check for initialization
     if (g_mem.flag == FALSE) 
         memRestore();
     else 
         memcpy( &c_mem, &g_mem, sizeof(g_mem) );
-    
+
+    stiffLutSetup();
 }
 
 
@@ -979,6 +1528,7 @@ uint8 memRestore(void) {
     for (i = 0; i < sizeof(g_mem); i++) 
         ((reg8 *) &g_mem.flag)[i] = EEPROM_ADDR[i + (DEFAULT_EEPROM_DISPLACEMENT * 16)];
     
+    memCheck();
 
     //check for initialization
     if (g_mem.flag == FALSE) 
@@ -988,6 +1538,155 @@ uint8 memRestore(void) {
    
 }
 
+//==============================================================================
+//                                                                  CHECK MEMORY
+//==============================================================================
+/**
+* memUpgrade() sets to default the parameters after max_step_pos, which were
+* not present in the memory written by older firmware versions. memCheck()
+* calls it when the layout version does not match, then brings every
+* parameter back in its range.
+**/
+
+void memUpgrade(void) {
+
+    uint8 CYDATA i;
+
+    g_mem.mem_version = MEM_VERSION;
+
+    g_mem.comm_deadline = DEFAULT_COMM_DEADLINE;
+
+    g_mem.base_rate = DEFAULT_BASE_RATE;
+    g_mem.pos_div = DEFAULT_POS_DIV;
+
+    g_mem.vel_estimator = VEL_EST_DIFFERENCE;
+
+    for (i = NUM_OF_FILTER_GROUPS; i--;)
+        filterDefault(i);
+
+    g_mem.pwm_dead = PWM_DEAD;
+
+    for (i = NUM_OF_MOTORS; i--;) {
+        g_mem.fric_coul[i][0] = 0;
+        g_mem.fric_coul[i][1] = 0;
+        g_mem.fric_visc[i] = 0;
+    }
+
+    g_mem.pos_int_limit = POS_INTEGRAL_SAT_LIMIT;
+    g_mem.curr_int_limit = CURR_INTEGRAL_SAT_LIMIT;
+
+    g_mem.k_vff = 0;
+    g_mem.k_aff = 0;
+    g_mem.k_vff_dl = 0;
+    g_mem.k_aff_dl = 0;
+
+    for (i = SPRING_MAP_SIZE; i--;)
+        g_mem.spring_map[i] = 0;
+}
+
+void memCheck(void) {
+
+    uint8 CYDATA i;
+
+    // Written with another layout
+    if (g_mem.mem_version != MEM_VERSION)
+        memUpgrade();
+
+    if ((g_mem.comm_deadline == 0) || (g_mem.comm_deadline > 100))
+        g_mem.comm_deadline = DEFAULT_COMM_DEADLINE;
+
+    if (!IS_POWER_OF_2(g_mem.base_rate) || (g_mem.base_rate > MAX_BASE_RATE))
+        g_mem.base_rate = DEFAULT_BASE_RATE;
+
+    if (!IS_POWER_OF_2(g_mem.pos_div) || (g_mem.pos_div > MAX_POS_DIV))
+        g_mem.pos_div = DEFAULT_POS_DIV;
+
+    if (g_mem.vel_estimator > VEL_EST_OBSERVER)
+        g_mem.vel_estimator = VEL_EST_DIFFERENCE;
+
+    // Spring map never recorded, or not a spring torque: it must be non
+    // decreasing on pretension to be inverted by stiffLutSetup()
+    for (i = 1; i < SPRING_MAP_SIZE; i++)
+        if (g_mem.spring_map[i] < g_mem.spring_map[i - 1])
+            break;
+    if ((i < SPRING_MAP_SIZE) || (g_mem.spring_map[SPRING_MAP_SIZE - 1] == 0xFFFF))
+        for (i = SPRING_MAP_SIZE; i--;)
+            g_mem.spring_map[i] = 0;
+
+    for (i = NUM_OF_FILTER_GROUPS; i--;)
+        if (!filterValid(&g_mem.filter[i]))
+            filterDefault(i);
+
+    // Deadband and friction within the PWM range
+    if (g_mem.pwm_dead > ((uint16)PWM_MAX_VALUE << PWM_OUT_SHIFT))
+        g_mem.pwm_dead = PWM_DEAD;
+
+    for (i = NUM_OF_MOTORS; i--;) {
+        if (g_mem.fric_coul[i][0] > ((uint16)PWM_MAX_VALUE << PWM_OUT_SHIFT))
+            g_mem.fric_coul[i][0] = 0;
+        if (g_mem.fric_coul[i][1] > ((uint16)PWM_MAX_VALUE << PWM_OUT_SHIFT))
+            g_mem.fric_coul[i][1] = 0;
+        if (g_mem.fric_visc[i] > 0x7FFF)
+            g_mem.fric_visc[i] = 0;
+    }
+
+    // Integral limits must be positive
+    if (g_mem.pos_int_limit <= 0)
+        g_mem.pos_int_limit = POS_INTEGRAL_SAT_LIMIT;
+    if (g_mem.curr_int_limit <= 0)
+        g_mem.curr_int_limit = CURR_INTEGRAL_SAT_LIMIT;
+
+    // Feedforward gains in [0, MAX_FF_GAIN]
+    if (!FF_GAIN_VALID(g_mem.k_vff))
+        g_mem.k_vff = 0;
+    if (!FF_GAIN_VALID(g_mem.k_aff))
+        g_mem.k_aff = 0;
+    if (!FF_GAIN_VALID(g_mem.k_vff_dl))
+        g_mem.k_vff_dl = 0;
+    if (!FF_GAIN_VALID(g_mem.k_aff_dl))
+        g_mem.k_aff_dl = 0;
+}
+
+//==============================================================================
+//                                                          FILTER CONFIGURATION
+//==============================================================================
+/**
+* filterValid() checks a filter configuration, filterDefault() sets the
+* default configuration of a filter group in g_mem.
+**/
+
+CYCODE int16 filter_default_alpha[NUM_OF_FILTER_GROUPS] = { DEFAULT_CURR_ALPHA,
+                                                            DEFAULT_CURR_LOOP_ALPHA,
+                                                            DEFAULT_VEL_ALPHA };
+
+uint8 filterValid(struct st_filter *cfg) {
+
+    switch(cfg->type) {
+        case FILTER_NONE:
+            return TRUE;
+
+        case FILTER_IIR:
+            return ((cfg->coef[0] > 0) && (cfg->coef[0] <= 1024));
+
+        case FILTER_BIQUAD:
+            // poles inside unit circle require |a2| < 1
+            return ((cfg->coef[4] > -16384) && (cfg->coef[4] < 16384));
+
+        default:
+            return FALSE;
+    }
+}
+
+void filterDefault(const uint8 group) {
+
+    uint8 CYDATA i;
+
+    g_mem.filter[group].type = FILTER_IIR;
+    g_mem.filter[group].coef[0] = filter_default_alpha[group];
+    for (i = 1; i < 5; i++)
+        g_mem.filter[group].coef[i] = 0;
+}
+
 //==============================================================================
 //                                                                   MEMORY INIT
 //==============================================================================
@@ -1040,6 +1739,8 @@ uint8 memInit(void) {
 
     g_mem.current_limit = DEFAULT_CURRENT_LIMIT;
 
+    memUpgrade();
+
     //set the initialized flag to show EEPROM has been populated
     g_mem.flag = TRUE;
 
@@ -1047,6 +1748,107 @@ uint8 memInit(void) {
     return ( memStore(0) && memStore(DEFAULT_EEPROM_DISPLACEMENT) );
 }
 
+//==============================================================================
+//                                                  POSITION AND STIFFNESS RULE
+//==============================================================================
+/**
+* This function converts equilibrium position and stiffness, as received by
+* CMD_SET_POS_STIFF, in motors references.
+**/
+
+void posStiffToRefs(int32 pos, int32 stiff, int32 *refs) {
+
+    uint8 CYDATA idx;
+    uint8 CYDATA sign;
+
+    // Convert position in ticks
+    pos = pos << g_mem.res[0];
+
+    // Check position limits
+    if (pos > (c_mem.pos_lim_sup[0] - c_mem.max_stiffness))
+        pos = c_mem.pos_lim_sup[0] - c_mem.max_stiffness;
+
+    if (pos < (c_mem.pos_lim_inf[0] + c_mem.max_stiffness))
+        pos = c_mem.pos_lim_inf[0] + c_mem.max_stiffness;
+
+    // Stiffness is intended between -32768 and 32767, as a fraction of the
+    // stiffness at MAX_STIFFNESS: remap it on pretension through stiff_lut
+    // and then between -MAX_STIFFNESS and MAX_STIFFNESS
+
+    sign = (stiff < 0);
+    if (sign)
+        stiff = -stiff;
+    if (stiff > 32767)
+        stiff = 32767;
+
+    idx = stiff >> STIFF_LUT_SHIFT;
+    stiff = stiff_lut[idx] + ((((int32)stiff_lut[idx + 1] - stiff_lut[idx]) * (stiff & ((1 << STIFF_LUT_SHIFT) - 1))) >> STIFF_LUT_SHIFT);
+
+    stiff = (stiff * c_mem.max_stiffness) >> 15;
+    if (sign)
+        stiff = -stiff;
+
+    // Store pos/stiff rule
+    refs[0] = pos + stiff;
+    refs[1] = pos - stiff;
+}
+
+//==============================================================================
+//                                                           STIFFNESS TABLE
+//==============================================================================
+/**
+* This function fills stiff_lut inverting the spring map: joint stiffness is
+* proportional to the spring torque slope on pretension, and stiffness
+* commands are spread linearly between the slopes at zero pretension and at
+* MAX_STIFFNESS. Slopes are made non decreasing. Without a valid map the
+* rule is linear.
+**/
+
+void stiffLutSetup(void) {
+
+    uint8 CYDATA j;
+    uint8 CYDATA k = 0;
+    int32 slope[SPRING_MAP_SIZE];
+    int32 CYDATA target;
+    uint32 CYDATA frac;
+
+    // Slope on 2 map steps, central differences
+    for (j = 0; j < SPRING_MAP_SIZE; j++) {
+        if (j == 0)
+            slope[j] = ((int32)c_mem.spring_map[1] - c_mem.spring_map[0]) << 1;
+        else if (j == SPRING_MAP_SIZE - 1)
+            slope[j] = ((int32)c_mem.spring_map[j] - c_mem.spring_map[j - 1]) << 1;
+        else
+            slope[j] = (int32)c_mem.spring_map[j + 1] - c_mem.spring_map[j - 1];
+
+        if (j && (slope[j] < slope[j - 1]))
+            slope[j] = slope[j - 1];
+    }
+
+    if (slope[SPRING_MAP_SIZE - 1] <= slope[0]) {
+        for (j = 0; j < STIFF_LUT_SIZE; j++)
+            stiff_lut[j] = (uint16)j << STIFF_LUT_SHIFT;
+        return;
+    }
+
+    for (j = 0; j < STIFF_LUT_SIZE; j++) {
+
+        target = slope[0] + ((slope[SPRING_MAP_SIZE - 1] - slope[0]) * j) / (STIFF_LUT_SIZE - 1);
+
+        while ((k < SPRING_MAP_SIZE - 2) && (slope[k + 1] < target))
+            k++;
+
+        // Pretension between map points k and k + 1, Q14 of a map step
+        frac = 0;
+        if (slope[k + 1] > slope[k])
+            frac = ((uint32)(target - slope[k]) << 14) / (uint32)(slope[k + 1] - slope[k]);
+        if (frac > 16384)
+            frac = 16384;
+
+        stiff_lut[j] = (((uint32)k << 15) + (frac << 1)) / (SPRING_MAP_SIZE - 1);
+    }
+}
+
 //==============================================================================
 //                                                    ROUTINE INTERRUPT FUNCTION
 //==============================================================================
@@ -1165,7 +1967,22 @@ void cmd_get_curr_and_meas(){
 }
 
 void cmd_set_inputs(){
+
+    uint8 CYDATA i;
+
+    // References belong to the calibration while it runs
+    if (calibration_flag != STOP)
+        return;
+
+    // Command, pos, vel and acc of each motor, checksum
+    if ((g_rx.buffer[0] == CMD_SET_INPUTS_FF) && (g_rx.length < 2 + NUM_OF_MOTORS * 6)) {
+        seqFrameReject(NACK_LENGTH);
+        return;
+    }
     
+    // Direct references stop trajectories
+    traj_flush();
+
     // Store position setted in right variables
     g_refNew.pos[0] = *((int16 *) &g_rx.buffer[1]);   // motor 1
     g_refNew.pos[0] = g_refNew.pos[0] << g_mem.res[0];
@@ -1186,6 +2003,15 @@ void cmd_set_inputs(){
         if (g_refNew.pos[1] > c_mem.pos_lim_sup[1]) 
             g_refNew.pos[1] = c_mem.pos_lim_sup[1];
     }
+
+    // Feedforward velocity and acceleration of the extended command
+    g_refNew.ff_ext = (g_rx.buffer[0] == CMD_SET_INPUTS_FF);
+    if (g_refNew.ff_ext) {
+        for (i = 0; i < NUM_OF_MOTORS; i++) {
+            g_refNew.vel[i] = (int32)(*((int16 *) &g_rx.buffer[5 + (i * 2)])) << g_mem.res[i];
+            g_refNew.acc[i] = (int32)(*((int16 *) &g_rx.buffer[9 + (i * 2)])) << g_mem.res[i];
+        }
+    }
 }
 
 void cmd_set_pos_stiff(){
@@ -1197,24 +2023,15 @@ void cmd_set_pos_stiff(){
     pos = *((int16 *) &g_rx.buffer[1]);      // equilibrium position
     stiff = *((int16 *) &g_rx.buffer[3]);    // stiffness
 
-    // Convert position in ticks
-    pos = pos << g_mem.res[0];
-
-    // Check position limits
-    if (pos > (c_mem.pos_lim_sup[0] - c_mem.max_stiffness))
-        pos = c_mem.pos_lim_sup[0] - c_mem.max_stiffness;
-
-    if (pos < (c_mem.pos_lim_inf[0] + c_mem.max_stiffness))
-        pos = c_mem.pos_lim_inf[0] + c_mem.max_stiffness;
+    // References belong to the calibration while it runs
+    if (calibration_flag != STOP)
+        return;
 
-    // Stiffness is intended between -32768 and 32767
-    // remap  stiff value between -MAX_STIFFNESS and MAX_STIFFNESS
-        
-    stiff = (int32)(((float) c_mem.max_stiffness / 32768.0) * stiff);
+    // Direct references stop trajectories
+    traj_flush();
 
-    // Store pos/stiff rule
-    g_refNew.pos[0] = pos + stiff;
-    g_refNew.pos[1] = pos - stiff;
+    posStiffToRefs(pos, stiff, g_refNew.pos);
+    g_refNew.ff_ext = FALSE;
 }
 
 void cmd_get_velocities(){
@@ -1235,7 +2052,7 @@ void cmd_get_velocities(){
     packet_data[0] = CMD_GET_VELOCITIES;   
    
     for (index = NUM_OF_SENSORS; index--;)
-        *((int16 *) &packet_data[(index << 2) + 1]) = (int16)(g_measOld.vel[index]);
+        *((int16 *) &packet_data[(index << 1) + 1]) = (int16)(g_measOld.vel[index]);
 
     // Calculate Checksum and send message to UART 
 
@@ -1251,20 +2068,31 @@ void cmd_get_velocities(){
 
 void cmd_activate(){
     
+    // Stop trajectories, friction identification and a running
+    // calibration, unless it is storing
+    traj_flush();
+    friction_ident_abort();
+    if ((calibration_flag != STOP) && (calibration_flag != STORE))
+        calibration_flag = ABORT;
+
+    // The host command replaces the startup activation
+    activ_pending = FALSE;
+
     // Store new value reads
     g_refNew.onoff = g_rx.buffer[1];
+    g_refNew.ff_ext = FALSE;
     
     // Check type of control mode enabled
     if (g_mem.control_mode == CONTROL_ANGLE || g_mem.control_mode == CURR_AND_POS_CONTROL
      || g_mem.control_mode == DEFLECTION_CONTROL || g_mem.control_mode == DEFL_CURRENT_CONTROL) {
-        g_refNew.pos[0] = g_meas.pos[0];
-        g_refNew.pos[1] = g_meas.pos[1];
+        g_refNew.pos[0] = g_measOld.pos[0];
+        g_refNew.pos[1] = g_measOld.pos[1];
     }
     
     // Safety start position (eliminate "lost rotation" problem)    
-    if((g_meas.pos[0] > 26000) || (g_meas.pos[0] < -26000) || 
-       (g_meas.pos[1] > 26000) || (g_meas.pos[1] < -26000) ||
-       (g_meas.pos[2] > 26000) || (g_meas.pos[2] < -26000))
+    if((g_measOld.pos[0] > 26000) || (g_measOld.pos[0] < -26000) || 
+       (g_measOld.pos[1] > 26000) || (g_measOld.pos[1] < -26000) ||
+       (g_measOld.pos[2] > 26000) || (g_measOld.pos[2] < -26000))
         g_refNew.onoff = 0x00;
     
     // Activate/Disactivate motors
@@ -1401,4 +2229,130 @@ void cmd_set_baudrate(){
     }
 }
 
+void cmd_set_traj_point(){
+
+    int32 CYDATA pos, stiff;
+    int32 refs[NUM_OF_MOTORS];
+
+    // Command, pos, stiff, dt, mode, checksum
+    if (g_rx.length < 9) {
+        seqFrameReject(NACK_LENGTH);
+        return;
+    }
+
+    // Load position, stiffness and time to reach them
+
+    pos = *((int16 *) &g_rx.buffer[1]);      // equilibrium position
+    stiff = *((int16 *) &g_rx.buffer[3]);    // stiffness
+
+    // References belong to the calibration while it runs
+    if (calibration_flag != STOP)
+        return;
+
+    posStiffToRefs(pos, stiff, refs);
+
+    traj_push(refs, *((uint16 *) &g_rx.buffer[5]), g_rx.buffer[7]);
+}
+
+void cmd_get_traj_status(){
+
+    // Packet: header + queued + size + running + underruns(int16) + dropped(int16) + crc
+
+    uint8 packet_data[9];
+
+    // Header
+    packet_data[0] = CMD_GET_TRAJ_STATUS;
+
+    // Load Payload
+    packet_data[1] = g_traj.count;
+    packet_data[2] = TRAJ_FIFO_SIZE;
+    packet_data[3] = g_traj.running;
+    *((int16 *) &packet_data[4]) = g_traj.underruns;
+    *((int16 *) &packet_data[6]) = g_traj.dropped;
+
+    // Calculate Checksum and send message to UART
+    packet_data[8] = LCRChecksum(packet_data, 8);
+    commWrite(packet_data, 9);
+}
+
+void cmd_get_calib_status(){
+
+    // Packet: header + state + steps + pretension(int16) + max_stiffness(int16) + failed + crc
+
+    uint8 packet_data[9];
+
+    // Header
+    packet_data[0] = CMD_GET_CALIB_STATUS;
+
+    // Load Payload
+    packet_data[1] = calibration_flag;
+    packet_data[2] = g_calib.steps;
+    *((int16 *) &packet_data[3]) = (int16)((g_calib.pre >> 8) >> c_mem.res[0]);
+    *((int16 *) &packet_data[5]) = (int16)(c_mem.max_stiffness >> c_mem.res[0]);
+    packet_data[7] = g_calib.failed;
+
+    // Calculate Checksum and send message to UART
+    packet_data[8] = LCRChecksum(packet_data, 8);
+    commWrite(packet_data, 9);
+}
+
+void cmd_get_autotune(){
+
+    // Packet: header + status + position PID(float[3]) + current PID(float[3]) + crc
+
+    uint8 packet_data[27];
+
+    // Header
+    packet_data[0] = CMD_GET_AUTOTUNE;
+
+    // Load Payload, staged gains of the control mode
+    packet_data[1] = tune_status;
+    if(c_mem.control_mode != CURR_AND_POS_CONTROL && c_mem.control_mode != DEFL_CURRENT_CONTROL) {
+        *((float *) &packet_data[2])  = (float) g_mem.k_p / 65536;
+        *((float *) &packet_data[6])  = (float) g_mem.k_i / 65536;
+        *((float *) &packet_data[10]) = (float) g_mem.k_d / 65536;
+        *((float *) &packet_data[14]) = (float) g_mem.k_p_c / 65536;
+        *((float *) &packet_data[18]) = (float) g_mem.k_i_c / 65536;
+        *((float *) &packet_data[22]) = (float) g_mem.k_d_c / 65536;
+    }
+    else {
+        *((float *) &packet_data[2])  = (float) g_mem.k_p_dl / 65536;
+        *((float *) &packet_data[6])  = (float) g_mem.k_i_dl / 65536;
+        *((float *) &packet_data[10]) = (float) g_mem.k_d_dl / 65536;
+        *((float *) &packet_data[14]) = (float) g_mem.k_p_c_dl / 65536;
+        *((float *) &packet_data[18]) = (float) g_mem.k_i_c_dl / 65536;
+        *((float *) &packet_data[22]) = (float) g_mem.k_d_c_dl / 65536;
+    }
+
+    // Calculate Checksum and send message to UART
+    packet_data[26] = LCRChecksum(packet_data, 26);
+    commWrite(packet_data, 27);
+}
+
+void cmd_get_fra(){
+
+    // Packet: header + status + points + done + [freq + gain + phase](float) x done + crc
+
+    uint8 packet_data[5 + 12 * FRA_MAX_POINTS];
+    uint8 CYDATA i;
+    uint8 CYDATA packet_lenght = 5 + 12 * g_fra.done;
+
+    // Header
+    packet_data[0] = CMD_GET_FRA;
+
+    // Load Payload
+    packet_data[1] = g_fra.status;
+    packet_data[2] = g_fra.points;
+    packet_data[3] = g_fra.done;
+    for (i = 0; i < g_fra.done; i++) {
+        *((float *) &packet_data[4 + 12 * i])  = g_fra.freq[i];
+        *((float *) &packet_data[8 + 12 * i])  = g_fra.gain[i];
+        *((float *) &packet_data[12 + 12 * i]) = g_fra.phase[i];
+    }
+
+    // Calculate Checksum and send message to UART
+    packet_data[packet_lenght - 1] = LCRChecksum(packet_data, packet_lenght - 1);
+    commWrite(packet_data, packet_lenght);
+}
+
 /* [] END OF FILE */
\ No newline at end of file
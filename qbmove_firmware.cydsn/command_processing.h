@@ -62,10 +62,22 @@ void    commProcess        	();
 void    commWrite          	(uint8*, const uint16);
 void    commWrite_old_id    (uint8*, const uint16, uint8);
 uint8   memStore           	(int);
+void    memStoreMark        (const uint8*, const uint8);
+uint8   memStoreStep        (void);
 void    sendAcknowledgment 	(const uint8);
+void    sendNack            (const uint8);
+uint8   seqFrameOpen        (void);
+void    seqFrameClose       (const uint8);
+void    seqFrameReject      (const uint8);
 void    memRecall          	(void);
+void    memUpgrade          (void);
+void    memCheck            (void);
+uint8   filterValid         (struct st_filter*);
+void    filterDefault       (const uint8);
 uint8   memRestore         	(void);
 uint8   memInit            	(void);
+void    posStiffToRefs      (int32, int32, int32*);
+void    stiffLutSetup       (void);
 
 //==============================================================================
 //                                            Service Routine interrupt function
@@ -84,6 +96,11 @@ void cmd_get_activate();
 void cmd_ping();
 void cmd_store_params();
 void cmd_set_baudrate();
+void cmd_set_traj_point();
+void cmd_get_traj_status();
+void cmd_get_calib_status();
+void cmd_get_autotune();
+void cmd_get_fra();
 
 #endif
 
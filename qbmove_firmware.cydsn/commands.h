@@ -114,8 +114,30 @@ enum qbmove_command {
                                         ///  (Only for Cuff device)
     CMD_SET_WATCHDOG            = 143,  ///< Command for setting watchdog timer
                                         ///  or disable it
-    CMD_SET_BAUDRATE            = 144   ///< Command for setting baudrate
+    CMD_SET_BAUDRATE            = 144,  ///< Command for setting baudrate
                                         ///  of communication
+    CMD_SEQ_FRAME               = 145,  ///< Sequenced frame, wraps any other
+                                        ///  command with a sequence number
+    CMD_SEQ_NACK                = 146,  ///< Reply to a rejected frame while
+                                        ///  sequenced frames are in use
+    CMD_SET_TRAJ_POINT          = 147,  ///< Command for queuing a trajectory
+                                        ///  waypoint
+    CMD_GET_TRAJ_STATUS         = 148,  ///< Command for getting trajectory
+                                        ///  queue state
+    CMD_FRICTION_IDENT          = 149,  ///< Starts the identification of
+                                        ///  motors breakaway PWM
+    CMD_SET_INPUTS_FF           = 150,  ///< Command for setting reference inputs
+                                        ///  with their feedforward
+    CMD_GET_CALIB_STATUS        = 151,  ///< Command for getting stiffness
+                                        ///  calibration progress
+    CMD_AUTOTUNE                = 152,  ///< Starts the relay autotuning of
+                                        ///  the control mode loops
+    CMD_GET_AUTOTUNE            = 153,  ///< Command for getting autotuning
+                                        ///  status and gains
+    CMD_FRA_START               = 154,  ///< Starts a frequency response
+                                        ///  analysis sweep
+    CMD_GET_FRA                 = 155   ///< Command for getting frequency
+                                        ///  response analysis results
 };
 
 /** \} */
@@ -198,6 +220,28 @@ enum qbmove_control_mode {
 };
 
 
+//============================================================     filter types
+
+enum qbmove_filter_type {
+
+    FILTER_NONE             = 0,        ///< No filter
+    FILTER_IIR              = 1,        ///< First order low pass, alpha in Q10
+                                        ///  at 1 kHz
+    FILTER_BIQUAD           = 2         ///< Biquad, b0 b1 b2 a1 a2 in Q14
+
+};
+
+
+//=======================================================     velocity estimators
+
+enum qbmove_vel_estimator {
+
+    VEL_EST_DIFFERENCE      = 0,        ///< Filtered position difference
+    VEL_EST_OBSERVER        = 1         ///< Tracking loop observer
+
+};
+
+
 //====================================================     acknowledgment values
 
 enum acknowledgment_values
@@ -206,6 +250,129 @@ enum acknowledgment_values
     ACK_OK              = 1
 };
 
+//==================================================     sequenced frame format
+/** \name Sequenced frames
+ *
+ *  Request:  | CMD_SEQ_FRAME | seq | command | payload | checksum |
+ *  Reply:    | CMD_SEQ_FRAME | seq | reply packet     | checksum |
+ *  Nack:     | CMD_SEQ_NACK  | last executed seq | reason | checksum |,
+ *            with a rejected inner command the seq of its frame.
+ *
+ *  A frame carrying the same seq of the last executed one is a
+ *  retransmission: the cached reply is sent again and the command is not
+ *  executed twice. Commands without a reply are answered with an ACK_OK
+ *  packet, unknown commands with NACK_COMMAND, commands shorter than
+ *  their payload with NACK_LENGTH and parameter values out of range with
+ *  NACK_VALUE, none of them executed. Nacks are sent only while
+ *  the host is using sequenced frames, any valid plain frame switches the
+ *  extension off. Frames with an invalid length byte are dropped with no
+ *  reply, as the host may still be transmitting them: it has to time out
+ *  and retry.
+ * \{
+**/
+
+enum seq_nack_reason
+{
+    NACK_CHECKSUM       = 1,    ///< Wrong checksum
+    NACK_LENGTH         = 2,    ///< Sequenced frame or inner command too short
+    NACK_COMMAND        = 3,    ///< Unknown inner command, not executed
+    NACK_VALUE          = 4     ///< Parameter value out of range, not set
+};
+
+/** \} */
+
+//===================================================     trajectory waypoints
+/** \name Trajectory waypoints
+ *
+ *  Waypoint: | CMD_SET_TRAJ_POINT | pos | stiff | dt | mode | checksum |
+ *            pos and stiff int16 as in CMD_SET_POS_STIFF, dt uint16 time to
+ *            reach the waypoint in ms, mode uint8 interpolation mode.
+ *  Status:   | CMD_GET_TRAJ_STATUS | queued | size | running | underruns |
+ *            dropped | checksum |, underruns and dropped int16.
+ *
+ *  Waypoints are interpolated every control cycle into the motor references.
+ *  When the queue runs empty the last waypoint is held and, unless it was
+ *  flagged with TRAJ_END, an underrun is counted. Waypoints received while
+ *  the queue is full are dropped. CMD_SET_INPUTS, CMD_SET_POS_STIFF and
+ *  CMD_ACTIVATE flush the queue.
+ * \{
+**/
+
+enum traj_mode
+{
+    TRAJ_LINEAR         = 0,    ///< Linear interpolation
+    TRAJ_HERMITE        = 1,    ///< Cubic Hermite, Catmull-Rom tangents
+    TRAJ_MIN_JERK       = 2,    ///< Minimum jerk, stops on each waypoint
+    TRAJ_END            = 0x80  ///< Flag, last waypoint of the trajectory
+};
+
+/** \} */
+
+//===================================================     calibration status
+/*
+ *  Status:   | CMD_GET_CALIB_STATUS | state | steps | pre | max_stiffness |
+ *            failed | checksum |, state uint8 as enum calibration_status,
+ *            steps uint8 spring map steps kept, pre and max_stiffness
+ *            int16 pretension reference and last result, in the same units
+ *            as CMD_SET_INPUTS, failed uint8 last calibration aborted or
+ *            not stored.
+ *
+ *  CMD_CALIBRATE is answered with ACK_ERROR while a calibration runs.
+ *  Reference commands are ignored until it ends, CMD_ACTIVATE aborts it.
+ */
+
+//=======================================================     relay autotuning
+/*
+ *  Start:    | CMD_AUTOTUNE | apply | checksum |, apply uint8, if not 0 the
+ *            gains are also applied at the end, otherwise only staged in
+ *            the parameters to be stored. Motors must be active.
+ *  Status:   | CMD_GET_AUTOTUNE | status | pos PID | curr PID | checksum |,
+ *            status uint8 as enum autotune_status, PIDs float[3] staged for
+ *            the control mode, double loop ones in cascade modes.
+ */
+
+//==============================================     frequency response analysis
+/** \name Frequency response analysis
+ *
+ *  Start:    | CMD_FRA_START | input | output | points | f_start | f_stop |
+ *            amp | checksum |, input uint8 as enum fra_input, output uint8
+ *            sensor position index or, from NUM_OF_SENSORS, motor current,
+ *            points uint8 up to FRA_MAX_POINTS, f_start and f_stop uint16
+ *            in 0.1 Hz up to 1/8 of the frequency of the loop excited (main
+ *            frequency, divided by pos_div in position modes), amp int16 in
+ *            the units of CMD_SET_INPUTS or in PWM %. Motors must be active.
+ *            A shorter frame does not start the sweep, it is answered with
+ *            NACK_LENGTH in a sequenced frame, with ACK_ERROR otherwise.
+ *  Results:  | CMD_GET_FRA | status | points | done | [freq | gain | phase]
+ *            x done | checksum |, status uint8 as enum fra_status, freq [Hz],
+ *            gain output / input and phase [deg] float.
+ *
+ *  Frequencies are log spaced and measured in a stepped sine sweep. Gain
+ *  and phase are on the excitation of the motor of the output, the first
+ *  one for the other sensors.
+ * \{
+**/
+
+enum fra_input
+{
+    FRA_INPUT_REF       = 0,    ///< Added to the motors position references
+    FRA_INPUT_PWM       = 1     ///< Added to the motors PWM, closed loop
+};
+
+/** \} */
+
+//===================================================     feedforward inputs
+/*
+ *  Inputs:   | CMD_SET_INPUTS_FF | pos | vel | acc | checksum |
+ *            pos, vel and acc int16 for each motor, vel in ticks/ms and
+ *            acc in ticks/ms^2 Q8, in the same units as pos of CMD_SET_INPUTS.
+ *
+ *  They are used by the velocity and acceleration feedforward of the
+ *  position control modes until the next inputs. Otherwise feedforward is
+ *  computed on the derivatives of the references. Frames shorter than
+ *  the whole payload are ignored.
+ */
+
 //==============================================    data types enumeration
 
 enum data_types {
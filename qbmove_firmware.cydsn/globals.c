@@ -48,22 +48,43 @@
 
 //=============================================      global variables definition
 
-struct st_ref   g_ref, g_refNew, g_refOld;  // motor variables
-struct st_meas  g_meas, g_measOld;          // measurements
+struct st_ref   g_ref_buf[2], g_refNew;     // motor variables
+struct st_meas  g_meas_buf[2];              // measurements
 struct st_data  g_rx;                       // income data
 struct st_mem   g_mem, c_mem;               // memory
+struct st_traj  g_traj;                     // trajectory waypoints
 
 // Timer value for debug field
 
 uint32 timer_value;
 uint32 timer_value0;
 
+// Communication scheduling
+
+uint32 timer_cycle;
+uint32 comm_deadline;
+
+// Control rates
+
+uint8 rate_shift;
+uint8 pos_div_shift;
+
+// Double buffered state
+
+struct st_ref  CYXDATA * CYDATA g_ref_ptr     = &g_ref_buf[0];
+struct st_ref  CYXDATA * CYDATA g_refOld_ptr  = &g_ref_buf[1];
+struct st_meas CYXDATA * CYDATA g_meas_ptr    = &g_meas_buf[0];
+struct st_meas CYXDATA * CYDATA g_measOld_ptr = &g_meas_buf[1];
+
 // Device Data
 
 int32   dev_tension;                // Power supply tension
 uint8   dev_pwm_limit;
 
 uint8 calibration_flag;
+struct st_calib g_calib;
+uint8 tune_status;
+struct st_fra g_fra;
 
 // Bit Flag
 
@@ -71,10 +92,13 @@ CYBIT reset_last_value_flag;
 CYBIT tension_valid;
 CYBIT interrupt_flag;
 CYBIT watchdog_flag;
+CYBIT activ_pending;
 
 // DMA Buffer
 
-int16 ADC_buf[3]; 
+int16 ADC_buf[ADC_BUFFERS][ADC_OVERSAMPLING][ADC_CHANNELS]; 
+uint8 DMA_Chan;
+uint8 DMA_TD[ADC_BUFFERS];
 
 // PWM Sign
 
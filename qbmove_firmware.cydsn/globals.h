@@ -60,7 +60,11 @@
 #define NUM_OF_MOTORS           2
 #define NUM_OF_SENSORS          3
 #define NUM_OF_ANALOG_INPUTS    3
-#define NUM_OF_PARAMS           13
+#define NUM_OF_PARAMS           22
+
+#define PARAM_MENU_OFFSET       (2 + NUM_OF_PARAMS * PARAM_BYTE_SLOT)   // menus position in param list
+#define PARAM_LIST_LENGTH       (PARAM_MENU_OFFSET + 549)               // menus, padding and checksum
+#define INFO_STRING_SIZE        1344    // INFO_ALL string, worst case 1342 chars with |m_mult| < 10^6
 
 //==============================================================================
 //                                                                       CONTROL
@@ -68,27 +72,134 @@
 
 #define PWM_MAX_VALUE   100         // PWM is from 0 to 100, this value is used
                                     // to limit this value
-#define PWM_DEAD        0           // deadband value, is directly added to the
-                                    // value of PWM always limited to 100
-
-// WARNING POS_INTEGRAL_SAT_LIMIT need to be lower than 2^17 or you have to modify
-// the code in the motor control function
+#define PWM_PERIOD      100         // PWM_MOTORS period, i.e. duty cycle resolution.
+                                    // Above 255 PWM_MOTORS must be 16 bit, with
+                                    // its clock scaled to keep the PWM frequency
+#define PWM_OUT_SHIFT   8           // control output in PWM_MAX_VALUE >> PWM_OUT_SHIFT units
+#define PWM_DEAD        0           // default deadband value, added to the non
+                                    // zero outputs of closed loop controls
+
+#define PWM_LIMIT_MIN_TENSION   8000    // [mV] full PWM below, start of the limits table
+#define PWM_CUTOFF_TENSION      25500   // [mV] motors cut off above
+#define PWM_CUTOFF_HYST         500     // [mV] cut off released below PWM_CUTOFF_TENSION - PWM_CUTOFF_HYST
+
+// Default integral limits, stored in c_mem. They are given at 1 kHz and
+// scaled with the loop frequency. Besides them, errors are not integrated
+// while the loop output is saturated in the same direction.
 #define POS_INTEGRAL_SAT_LIMIT   100000  // Anti wind-up
 #define CURR_INTEGRAL_SAT_LIMIT  100000  // Anti wind-up
+#define MAX_FF_GAIN              ((int32)2048 << 16) // Feedforward gains limit, output per tick/ms
 #define CALIB_CURRENT            1000    // Max current for calibration (mA)
+#define CALIB_STEP               (65536 / 720)   // Spring map recording step, 0.5 degree
+#define CALIB_RAMP_FAST          2097    // Pretension ramp far from contact, Q8 ticks/ms (45 deg/s)
+#define CALIB_RAMP_SLOW          233     // Pretension ramp at CALIB_CURRENT, Q8 ticks/ms (5 deg/s)
+#define CALIB_PAUSE              500     // ms to reach zero position
+#define SPRING_CALIB_STEPS       128     // Pretension steps kept by calibration, halved when full
+#define SPRING_MAP_SIZE          16      // Spring map points, from 0 to max_stiffness
+#define STIFF_LUT_SIZE           17      // Stiffness to pretension table, 2^n + 1 points
+#define STIFF_LUT_SHIFT          11      // 32768 >> STIFF_LUT_SHIFT = STIFF_LUT_SIZE - 1
 #define DEFAULT_CURRENT_LIMIT    1500    // Current limit when using CURR_AND_POS_CONTROL
+
+// Friction identification, PWM in PWM_OUT_SHIFT units
+#define FRIC_IDENT_RAMP          4       // PWM increase per ms
+#define FRIC_IDENT_MOVE          64      // ticks moved at breakaway
+#define FRIC_IDENT_REST          200     // ms of rest before each ramp
+#define FRIC_IDENT_MAX           ((int32)(PWM_MAX_VALUE >> 1) << PWM_OUT_SHIFT)  // ramp abort
+#define FRIC_VEL_DEAD            1       // reference velocity [ticks/ms] without Coulomb compensation
+
+// Relay autotuning
+#define TUNE_RELAY_PWM           20      // relay output on PWM, position and current loops
+#define TUNE_RELAY_CURR          200     // relay output on current [mA], cascade outer loop
+#define TUNE_POS_HYST            32      // relay hysteresis [ticks]
+#define TUNE_CURR_HYST           20      // relay hysteresis [mA]
+#define TUNE_SKIP                2       // relay periods skipped, transient
+#define TUNE_PERIODS             4       // relay periods measured
+#define TUNE_TIMEOUT             10000   // ms for each loop
+
+// Frequency response analysis
+#define FRA_MAX_POINTS           16      // frequency points of a sweep
+#define FRA_SETTLE               2       // periods before measuring each point
+#define FRA_PERIODS              4       // min periods measured for each point
+#define FRA_MIN_TIME             500     // min ms measured for each point
+#define FRA_MAX_PERIODS          200
+#define FRA_FLUSH                64      // samples summed in 32 bits, then in float
+
+// Feedforward on references derivatives, low pass filtered with a time
+// constant of 2^FF_FILTER_SHIFT cycles
+#define FF_FILTER_SHIFT          2
     
 
 //==============================================================================
 //                                                               SYNCHRONIZATION
 //==============================================================================
 
-// Main frequency 1000 Hz
+// Main frequency 1000 Hz << rate_shift, set through PACER_TIMER period
 
-#define CALIBRATION_DIV         100     // 10 Hz
+#define DEFAULT_BASE_RATE       1       // kHz
+#define MAX_BASE_RATE           4       // kHz
+#define DEFAULT_POS_DIV         1       // Position loop at main frequency
+#define MAX_POS_DIV             8
 
 #define DIV_INIT_VALUE          1
 
+#define MY_TIMER_START          5000000 // MY_TIMER value at the beginning of each cycle
+#define DEFAULT_COMM_DEADLINE   90      // Stop parsing packets after 90% of the cycle
+#define COMM_SLICE              5       // Max parsing time between two tasks, % of cycle
+
+#define PERCENT_OF_CYCLE(P)     (((timer_cycle * (P)) * 41) >> 12)  // MY_TIMER counts
+
+#define IS_POWER_OF_2(X)        ((X) && !((X) & ((X) - 1)))
+#define RATE_SCALE(X, S)        (((S) >= 0) ? ((X) << (S)) : ((X) >> -(S)))
+#define FF_GAIN_VALID(X)        (((X) >= 0) && ((X) <= MAX_FF_GAIN))
+
+//==============================================================================
+//                                                                       FILTERS
+//==============================================================================
+
+#define NUM_OF_FILTER_GROUPS    3
+
+enum filter_group {
+
+    FILTER_GROUP_CURR       = 0,    // currents
+    FILTER_GROUP_CURR_LOOP  = 1,    // current loops currents
+    FILTER_GROUP_VEL        = 2     // velocities
+
+};
+
+#define NUM_OF_FILTERS          7
+
+enum filter_channel {
+
+    FILTER_CURR_1           = 0,
+    FILTER_CURR_2           = 1,
+    FILTER_CURR_LOOP_1      = 2,
+    FILTER_CURR_LOOP_2      = 3,
+    FILTER_VEL_1            = 4,
+    FILTER_VEL_2            = 5,
+    FILTER_VEL_3            = 6
+
+};
+
+#define DEFAULT_CURR_ALPHA      3       // Q10 at 1 kHz
+#define DEFAULT_CURR_LOOP_ALPHA 512
+#define DEFAULT_VEL_ALPHA       300
+
+//==============================================================================
+//                                                                         TASKS
+//==============================================================================
+
+#define NUM_OF_TASKS            5
+
+enum task_id {
+
+    TASK_ENCODERS       = 0,
+    TASK_ANALOG         = 1,
+    TASK_CONTROL        = 2,
+    TASK_TRAJECTORY     = 3,
+    TASK_CALIBRATION    = 4
+
+};
+
 //==============================================================================
 //                                                                           DMA
 //==============================================================================
@@ -97,6 +208,22 @@
 #define DMA_REQUEST_PER_BURST 1
 #define DMA_SRC_BASE (CYDEV_PERIPH_BASE)
 #define DMA_DST_BASE (CYDEV_SRAM_BASE)
+
+#define ADC_CHANNELS        3               // tension, current 1, current 2
+#define ADC_BUFFERS         2               // DMA alternates buffers at each cycle
+#define ADC_OVERSAMPLING    4               // conversions averaged in each cycle
+#define ADC_OVERSAMPLING_SHIFT  2
+#define ADC_PWM_PHASE       (PWM_PERIOD >> 1)           // PWM counter at conversions start
+#define ADC_PWM_WINDOW      ((PWM_PERIOD >> 3) + 1)     // PWM counts accepted after ADC_PWM_PHASE
+
+#if ADC_OVERSAMPLING > (NUM_OF_TASKS + 1)
+#error "conversions are started one before each task and one at the end of the cycle"
+#endif
+
+#define ADC_ZERO            1638            // counts at zero tension or current, default offset
+#define CURR_OFFSET_SETTLE  20              // ms waited after motors deactivation
+#define CURR_OFFSET_SAMPLES_SHIFT   8       // 256 cycles averaged for each offset measure
+#define CURR_OFFSET_TRIM_SHIFT      10      // trim while motors are off, 1024 cycles time constant
     
 //==============================================================================
 //                                                                     INTERRUPT
@@ -106,6 +233,8 @@
 #define    WAIT_LENGTH  2
 #define    RECEIVE      3
 #define    UNLOAD       4
+
+#define SEQ_CACHE_SIZE  32              // Max reply length kept for retransmissions
     
 //==============================================================================
 //                                                                         OTHER
@@ -114,7 +243,14 @@
 #define FALSE           0
 #define TRUE            1
 
-#define DEFAULT_EEPROM_DISPLACEMENT 8   // in pages
+#define DEFAULT_EEPROM_DISPLACEMENT 16  // in pages, st_mem must fit in it
+#define OLD_EEPROM_DISPLACEMENT 8       // in pages, default memory of the layout before mem_version
+#define MEM_VERSION     1               // st_mem layout, see memCheck()
+
+// memStoreStep() results
+#define STORE_DONE      0
+#define STORE_PENDING   1
+#define STORE_FAILED    2
     
 #define MAX_WATCHDOG_TIMER 250          // num * 2 [cs]
 
@@ -128,16 +264,84 @@
 struct st_ref {
 
     int32 pos[NUM_OF_MOTORS];       // motor reference position
+    int32 vel[NUM_OF_MOTORS];       // reference velocity [ticks/ms]
+    int32 acc[NUM_OF_MOTORS];       // reference acceleration [ticks/ms^2, Q8]
+    uint8 ff_ext;                   // vel and acc given by the host
     uint8 onoff;                    // enable flags
 
 };
 
+//====================================================================     tasks
+
+struct st_task {
+
+    uint8   deadline_pct;           // latest start, % of cycle (0 = none)
+    uint8   budget_pct;             // expected execution time, % of cycle (0 = none)
+    uint32  deadline;               // latest start, MY_TIMER counts
+    uint32  budget;                 // expected execution time, MY_TIMER counts
+    uint32  exec;                   // last execution time, MY_TIMER counts
+    uint16  overruns;               // executions longer than budget
+    uint16  misses;                 // executions skipped for missed deadline
+
+};
+
+//============================================================     control gains
+
+struct st_gains {
+
+    int32   k_p;                    // position loop gains
+    int32   k_i;
+    int32   k_d;
+    int32   k_p_c;                  // current loop gains
+    int32   k_i_c;
+    int32   k_d_c;
+    int32   k_vff;                  // feedforward gains
+    int32   k_aff;
+    int32   pos_sat;                // position error sum limit
+    int32   curr_sat;               // current error sum limit
+
+    int32   lim_p;                  // fxp_lim() of the gains, for FXP_MUL_LIM
+    int32   lim_i;
+    int32   lim_d;
+    int32   lim_p_c;
+    int32   lim_i_c;
+    int32   lim_d_c;
+    int32   lim_vff;
+    int32   lim_aff;
+
+};
+
+//===============================================================     trajectory
+
+#define TRAJ_FIFO_SIZE          16      // must be a power of 2
+
+struct st_traj_point {
+
+    int32   pos[NUM_OF_MOTORS];     // motor references
+    uint16  dt;                     // time to reach the point [ms]
+    uint8   mode;                   // interpolation mode
+
+};
+
+struct st_traj {
+
+    struct st_traj_point fifo[TRAJ_FIFO_SIZE];
+    uint8   head;                   // next free slot
+    uint8   tail;                   // next point to be reached
+    uint8   count;                  // queued points
+    uint8   running;                // moving along the trajectory
+    uint16  underruns;              // queue run empty while moving
+    uint16  dropped;                // points received with full queue
+
+};
+
 //=============================================================     measurements
 
 struct st_meas {
 
     int32 pos[NUM_OF_SENSORS];      // sensor position
     int32 curr[NUM_OF_MOTORS];      // motor currents
+    int32 curr_loop[NUM_OF_MOTORS]; // lightly filtered currents, current loops
     int8 rot[NUM_OF_SENSORS];       // sensor rotations
     int16 vel[NUM_OF_SENSORS];      // sensor velocity
 
@@ -151,6 +355,16 @@ struct st_data {
     int16   length;                         // length
     int16   ind;                            // index
     uint8   ready;                          // Flag
+    uint8   broadcast;                      // Flag, frame sent to ID 0
+
+};
+
+//==================================================================     filters
+
+struct st_filter {
+
+    uint8   type;                   // filter type
+    int16   coef[5];                // coefficients, depending on type
 
 };
 
@@ -196,7 +410,24 @@ struct st_mem {
     uint8   watchdog_period;            // Watchdog period setted, 255 = disable    1
     int32   max_step_neg;               // Maximum velocity for negative inputs     4       
     int32   max_step_pos;               // Maximum velocity for positive inputs     4       
-                                                                                    //TOT   112
+    uint8   mem_version;                // Layout of the fields below, MEM_VERSION  1
+    uint8   comm_deadline;              // Packets parsing deadline, % of cycle     1
+    uint8   base_rate;                  // Main frequency [kHz]                     1
+    uint8   pos_div;                    // Position loop divider                    1
+    uint8   vel_estimator;              // Velocity estimator                       1
+    struct st_filter filter[NUM_OF_FILTER_GROUPS];  // Filters configuration    11 (33)
+    uint16  pwm_dead;                   // Deadband offset [PWM_OUT_SHIFT units]    2
+    uint16  fric_coul[NUM_OF_MOTORS][2];// Coulomb friction [+, -], as pwm_dead     4 (8)
+    uint16  fric_visc[NUM_OF_MOTORS];   // Viscous friction, on ref. vel. as k_d    2 (4)
+    int32   pos_int_limit;              // Position loops integral limit            4
+    int32   curr_int_limit;             // Current loops integral limit             4
+    int32   k_vff;                      // Velocity feedforward                     4
+    int32   k_aff;                      // Acceleration feedforward                 4
+    int32   k_vff_dl;                   // Velocity feedforward double loop         4
+    int32   k_aff_dl;                   // Acceleration feedforward double loop     4
+    uint16  spring_map[SPRING_MAP_SIZE];// Spring torque [mA] on pretension, from
+                                        // 0 to max_stiffness, set by calibration   2 (32)
+                                                                                    //TOT   220
 };
 
 
@@ -210,21 +441,73 @@ enum calibration_status {
     CONTINUE_1  = 2,
     CONTINUE_2  = 3,
     PAUSE_1     = 4,
-    PAUSE_2     = 5
+    PAUSE_2     = 5,
+    ABORT       = 6,
+    STORE       = 7
+
+};
+
+struct st_calib {
+
+    int32   pre;                    // pretension reference, Q8 ticks
+    uint8   steps;                  // spring map steps recorded
+    uint8   failed;                 // last calibration aborted or not stored
+
+};
+
+//=================================================     autotuning status
+
+enum autotune_status {
+
+    TUNE_IDLE       = 0,
+    TUNE_RUNNING    = 1,
+    TUNE_DONE       = 2,
+    TUNE_FAILED     = 3
+
+};
+
+//===========================================     frequency response analysis
+
+enum fra_status {
+
+    FRA_IDLE        = 0,
+    FRA_RUNNING     = 1,
+    FRA_DONE        = 2,
+    FRA_FAILED      = 3
+
+};
+
+struct st_fra {
+
+    float   freq[FRA_MAX_POINTS];   // [Hz]
+    float   gain[FRA_MAX_POINTS];   // output / input
+    float   phase[FRA_MAX_POINTS];  // output - input [deg]
+    uint8   points;                 // requested points
+    uint8   done;                   // measured points
+    uint8   status;                 // enum fra_status
 
 };
 
 //====================================      external global variables declaration
 
 
-extern struct st_ref    g_ref, g_refNew, g_refOld;  // motor variables
-extern struct st_meas   g_meas, g_measOld;          // measurements
+extern struct st_ref    g_ref_buf[2], g_refNew;     // motor variables
+extern struct st_meas   g_meas_buf[2];              // measurements
 extern struct st_data   g_rx;                       // income data
 extern struct st_mem    g_mem, c_mem;               // memory
+extern struct st_traj   g_traj;                     // trajectory waypoints
 
 
 extern uint32 timer_value;
 extern uint32 timer_value0;
+extern uint32 timer_cycle;                          // MY_TIMER counts in a cycle
+extern uint32 comm_deadline;                        // MY_TIMER counts for parsing
+extern uint8  rate_shift;                           // main frequency = 1 kHz << rate_shift
+extern uint8  pos_div_shift;                        // position loop divider = 1 << pos_div_shift
+extern struct st_ref  CYXDATA * CYDATA g_ref_ptr;     // g_ref_buf[] holding k references
+extern struct st_ref  CYXDATA * CYDATA g_refOld_ptr;  // and k-1 ones
+extern struct st_meas CYXDATA * CYDATA g_meas_ptr;    // g_meas_buf[] holding k measurements
+extern struct st_meas CYXDATA * CYDATA g_measOld_ptr; // and k-1 ones
 
 // Device Data
 
@@ -232,6 +515,9 @@ extern int32   dev_tension;                         // Power supply tension
 extern uint8   dev_pwm_limit;
 
 extern uint8 calibration_flag;
+extern struct st_calib g_calib;
+extern uint8 tune_status;
+extern struct st_fra g_fra;
 
 // Bit Flag
 
@@ -239,14 +525,28 @@ extern CYBIT reset_last_value_flag;
 extern CYBIT tension_valid;                         // tension validation bit
 extern CYBIT interrupt_flag;                        // interrupt flag enabler
 extern CYBIT watchdog_flag;                         // watchdog flag enabler
+extern CYBIT activ_pending;                         // startup activation waits for current offsets
 
 // DMA Buffer
 
-extern int16 ADC_buf[3];
+extern int16 ADC_buf[ADC_BUFFERS][ADC_OVERSAMPLING][ADC_CHANNELS];
+extern uint8 DMA_Chan;
+extern uint8 DMA_TD[ADC_BUFFERS];                   // one TD for each buffer
 
 // PWM Sign Value
 extern int8 pwm_sign[NUM_OF_MOTORS];
 
+//====================================================      double buffered state
+
+// k and k-1 states swap buffers at the end of every cycle, with no copies,
+// by swapping the pointers. Measurement tasks write every field of g_meas in
+// each run.
+
+#define g_ref           (*g_ref_ptr)
+#define g_refOld        (*g_refOld_ptr)
+#define g_meas          (*g_meas_ptr)
+#define g_measOld       (*g_measOld_ptr)
+
 // -----------------------------------------------------------------------------
 
 #endif
@@ -52,6 +52,208 @@
 
 //===================================================================     global
 
+static void task_encoders(void);
+static void task_control(void);
+static void task_trajectory(void);
+static void task_calibration(void);
+static void task_run(const uint8);
+
+static void ctrl_input_encoder3(void);
+static void ctrl_output(void);
+static void ctrl_position(void);
+static void ctrl_cascade(void);
+static void ctrl_current(void);
+static void ctrl_pwm(void);
+static void ctrl_off(void);
+static void ctrl_friction_ident(void);
+static void ctrl_autotune(void);
+static void ctrl_kernel_run(void);
+static void curr_sat_setup(void);
+static void gains_lim_setup(void);
+
+static void tune_loop_start(const uint8);
+static void tune_loop_end(const uint8);
+static void tune_update(void);
+static int32 tune_relay(const uint8, const int32);
+
+static void fra_point_start(void);
+static void fra_update(void);
+static void fra_stop(const uint8);
+static void fra_flush(void);
+static int16 fra_sin(const uint8);
+
+static void ref_update(void);
+static void adc_trigger(const uint8);
+static void curr_offset_calibration(const int32, const int32);
+
+static void traj_segment_start(void);
+
+static void spring_map_build(void);
+
+static int16 velocity_estimation(const uint8, const int32);
+
+// Tasks table, indexed by enum task_id in order of priority. Deadline is the
+// latest start time and budget the expected execution time, both in % of the
+// control cycle (0 = none). Tasks are dispatched by task_run(), not through
+// function pointers, so that the C51 linker sees the call tree when it
+// overlays local variables. All of them run at every cycle, the position
+// loop divider is counted within the control task (pos_loop_tick), whose
+// current loop runs at every cycle.
+
+struct st_task tasks[NUM_OF_TASKS] = {
+//   deadline  budget
+    {0,        15},         // TASK_ENCODERS
+    {0,        10},         // TASK_ANALOG
+    {0,        25},         // TASK_CONTROL
+    {0,        10},         // TASK_TRAJECTORY
+    {60,       10}          // TASK_CALIBRATION
+};
+
+static uint32 comm_slice;                               // MY_TIMER counts
+
+static uint8 pos_loop_cnt = DIV_INIT_VALUE;             // position loop divider counter
+static CYBIT pos_loop_tick;                             // position loop runs in this cycle
+
+// Control kernel bound to the control mode and its gains, scaled to the loop
+// frequencies by control_setup(). Kernels are dispatched by ctrl_kernel_run()
+// for the same reason as tasks.
+
+#define KERNEL_OFF          0
+#define KERNEL_POSITION     1
+#define KERNEL_CASCADE      2
+#define KERNEL_CURRENT      3
+#define KERNEL_PWM          4
+#define KERNEL_FRIC_IDENT   5
+#define KERNEL_AUTOTUNE     6
+
+// FRA sums, for the means and the correlations with sine and cosine
+#define FRA_U               0
+#define FRA_Y               1
+#define FRA_S               2
+#define FRA_C               3
+#define FRA_US              4
+#define FRA_UC              5
+#define FRA_YS              6
+#define FRA_YC              7
+#define FRA_SUMS            8
+
+static uint8 control_kernel = KERNEL_OFF;
+static struct st_gains gains;
+static CYBIT ctrl_deflection;                           // deflection reference
+
+static int32 pos_error_sum[NUM_OF_MOTORS];
+static int32 curr_error_sum[NUM_OF_MOTORS];
+static int32 prev_curr_err[NUM_OF_MOTORS];
+static int32 casc_curr_ref[NUM_OF_MOTORS];              // cascade outer loop output
+static int32 pwm_out[NUM_OF_MOTORS];                    // kernels output
+
+// Output saturation of last cycle, +1, -1 or 0, for conditional integration
+static int8 pwm_sat[NUM_OF_MOTORS];                     // PWM range
+static int8 casc_sat[NUM_OF_MOTORS];                    // cascade current limit
+
+// Integrating ERR would push further an output saturated as SAT
+#define WINDS_UP(SAT, ERR)  ((((SAT) > 0) && ((ERR) > 0)) || (((SAT) < 0) && ((ERR) < 0)))
+
+// Friction identification, one ramp for each motor and direction
+static uint8 ident_step;                                // motor << 1 | negative direction
+static uint16 ident_rest;                               // rest cycles left
+static int32 ident_pwm;
+static int32 ident_pos0;                                // position at ramp start
+static uint16 ident_coul[NUM_OF_MOTORS][2];             // breakaway PWM found, stored at the end
+
+// Relay autotuning, loop under test and, for each motor, relay output and
+// oscillation measurement, timed in main cycles
+#define TUNE_LOOP_POS   1
+#define TUNE_LOOP_CURR  2
+#define TUNE_LOOP_CASC  3
+
+static uint8 tune_loop;                                 // 0 = none
+static CYBIT tune_apply;                                // apply gains to c_mem too
+static uint32 tune_time;
+static int32 tune_amp;                                  // relay output
+static int32 tune_hyst;                                 // relay hysteresis
+static int8 tune_out[NUM_OF_MOTORS];
+static uint8 tune_n[NUM_OF_MOTORS];                     // periods started
+static uint32 tune_t0[NUM_OF_MOTORS];                   // period start
+static uint32 tune_period[NUM_OF_MOTORS];               // measured periods sum
+static int32 tune_max[NUM_OF_MOTORS];                   // error extremes in the period
+static int32 tune_min[NUM_OF_MOTORS];
+static int32 tune_pp[NUM_OF_MOTORS];                    // measured peak to peak sum
+
+// Frequency response analysis, excitation and correlations of the point
+// being measured
+static uint8 fra_input;                                 // enum fra_input
+static uint8 fra_output;                                // sensor position or, after them, motor current
+static uint8 fra_motor;                                 // motor whose excitation is correlated
+static float fra_ratio;                                 // frequency ratio between points
+static int32 fra_amp[NUM_OF_MOTORS];                    // excitation amplitude, each motor units
+static int32 fra_u;                                     // excitation of fra_motor
+static int32 fra_ref[NUM_OF_MOTORS];                    // excitation on position references
+static int32 fra_pwm[NUM_OF_MOTORS];                    // excitation on closed loop PWM
+static int32 fra_y0;                                    // output at measure start
+static uint32 fra_phase;                                // excitation phase, 2^32 a period
+static uint32 fra_phase_step;
+static uint8 fra_turns;                                 // periods elapsed
+static uint8 fra_turns_end;
+static uint32 fra_n;                                    // samples correlated
+static int32 fra_acc[FRA_SUMS];                         // sums of the last samples, FRA_FLUSH at most
+static float fra_sum[FRA_SUMS];                         // sums of the point
+
+static int32 ref_step_pos[NUM_OF_MOTORS];               // max reference steps per cycle
+static int32 ref_step_neg[NUM_OF_MOTORS];
+
+// c_mem.m_mult as m_mult_mul / 2^m_mult_shift, normalized for resolution
+static int32 m_mult_mul[NUM_OF_SENSORS];
+static uint8 m_mult_shift[NUM_OF_SENSORS];
+static uint8 m_mult_active;                             // multipliers != 1, bitmask
+// Output stage scales from control output to PWM compare counts, in
+// Q(PWM_SCALE_SHIFT), without and with the supply PWM limit (Q8, scaled by
+// >> 10). Rounded up so that the full output reaches PWM_PERIOD. The shift
+// keeps the output product, about PWM_PERIOD << PWM_SCALE_SHIFT, within 31
+// bits, so that it is a plain multiplication.
+#if PWM_PERIOD < 128
+#define PWM_SCALE_SHIFT 24
+#elif PWM_PERIOD < 2048
+#define PWM_SCALE_SHIFT 20
+#else
+#define PWM_SCALE_SHIFT 14
+#endif
+#define PWM_SCALE_FULL  ((((int32)PWM_PERIOD << (PWM_SCALE_SHIFT - PWM_OUT_SHIFT)) + PWM_MAX_VALUE - 1) / PWM_MAX_VALUE)
+#define PWM_SCALE_LIMIT ((((int32)PWM_PERIOD << (PWM_SCALE_SHIFT + 2 - PWM_OUT_SHIFT)) + (int32)PWM_MAX_VALUE * PWM_MAX_VALUE - 1) / ((int32)PWM_MAX_VALUE * PWM_MAX_VALUE))
+
+static int32 pwm_scale;                                 // with PWM limit
+
+// ADC conversions, ADC_OVERSAMPLING per cycle, alternate ADC_buf[] buffers
+// through DMA at each cycle
+static uint8 adc_fill_idx;                              // buffer of the running conversions
+static uint8 adc_idx;                                   // last completed buffer
+static CYBIT adc_ready;                                 // adc_idx not yet consumed
+static uint8 adc_soc_cnt;                               // conversions started in this cycle
+static int8 adc_sign[ADC_BUFFERS][NUM_OF_MOTORS];       // pwm_sign at conversions start
+
+static int32 curr_offset[NUM_OF_MOTORS] = {             // current sensors offsets, Q12 counts
+    (int32)ADC_ZERO << 12, (int32)ADC_ZERO << 12 };
+static int32 curr_zero[NUM_OF_MOTORS] = {               // current sensors offsets, counts
+    ADC_ZERO, ADC_ZERO };
+
+// Trajectory segment being interpolated, from traj_p0 to traj_p1
+
+static int32 traj_p0[NUM_OF_MOTORS];
+static int32 traj_p1[NUM_OF_MOTORS];
+static int32 traj_m0[NUM_OF_MOTORS];                    // Hermite tangents
+static int32 traj_m1[NUM_OF_MOTORS];
+static uint16 traj_dt;                                  // segment duration [ms]
+static uint8 traj_mode;
+static uint32 traj_ticks;                               // cycles to segment end
+static uint32 traj_tau;                                 // segment fraction, Q31
+static uint32 traj_tau_step;
+
+// Spring map calibration, torque and measured pretension at each step,
+// every calib_step ticks of pretension reference
+static int16 calib_pre[SPRING_CALIB_STEPS];
+static uint16 calib_torque[SPRING_CALIB_STEPS];
+static int32 calib_step;
+
 
 // PWM vaules needed to obtain 8 Volts given a certain input tension
 // Numbers are sperimentally calculated //[index] (milliampere)
@@ -132,7 +334,7 @@ CY_ISR(ISR_RS485_RX_ExInterrupt) {
 //
 //==============================================================================
 
-void interrupt_manager(){
+void interrupt_manager(const uint32 limit){
 
     
     //===========================================     local variables definition
@@ -146,16 +348,16 @@ void interrupt_manager(){
     static uint8 CYDATA rx_queue[3];                    // last 2 bytes received
     //-------------------------------------------------
 
+    static CYBIT    rx_data_type;                       // my id?
     uint8 CYDATA    rx_data;                            // RS485 UART rx data
-    CYBIT           rx_data_type;                       // my id?
-    uint8 CYDATA    package_count = 0;                     
 
     //======================================================     receive routine
     
-    // Get data until buffer is not empty 
+    // Get data until buffer is not empty or the time limit is reached,
+    // so that packets processing does not delay the next control cycle
     
-    while(UART_RS485_GetRxBufferSize() && (package_count < 6)){  
-        // 6 stima di numero massimo di pacchetti che riesco a leggere senza bloccare l'esecuzione del firmware
+    while(UART_RS485_GetRxBufferSize() &&
+          ((MY_TIMER_START - (uint32)MY_TIMER_ReadCounter()) < limit)){
         
         // Get next char
         rx_data = UART_RS485_GetChar();
@@ -189,6 +391,8 @@ void interrupt_manager(){
                     rx_data_type = FALSE;
                 else                //packet is for others
                     rx_data_type = TRUE;
+
+                g_rx.broadcast = (rx_data == 0);
                 
                 data_packet_length = 0;
                 state = WAIT_LENGTH;
@@ -199,11 +403,10 @@ void interrupt_manager(){
 
  
                 data_packet_length = rx_data;
-                // check validity of pack length
-                if (data_packet_length <= 1) {
-                    data_packet_length = 0;
-                    state = WAIT_START;
-                } else if (data_packet_length > 128) {
+                // check validity of pack length. The frame is dropped with
+                // no reply: the host is still sending it on the half duplex
+                // bus, it will time out and retry
+                if ((data_packet_length <= 1) || (data_packet_length > 128)) {
                     data_packet_length = 0;
                     state = WAIT_START;
                 } else {
@@ -236,7 +439,6 @@ void interrupt_manager(){
                     data_packet_index  = 0;
                     data_packet_length = 0;
                     state              = WAIT_START;
-                    package_count++;
                 
                 }
                 break;
@@ -249,550 +451,1543 @@ void interrupt_manager(){
                     RS485_CTS_Write(1);
                     RS485_CTS_Write(0);
                     state              = WAIT_START;
-                    package_count++;
                 }
                 break;
         }
     }
+
+    // Data left in the buffer will be parsed in the next cycle
+    if (UART_RS485_GetRxBufferSize())
+        interrupt_flag = TRUE;
 }
 
 //==============================================================================
 //                                                            FUNCTION SCHEDULER
 //==============================================================================
-// Call all the function with the right frequency
+// Call all the tasks at every cycle, in order of priority.
+// Communication is served only between tasks, for at most comm_slice counts.
 //==============================================================================
-// Base frequency 1000 Hz
+// Base frequency 1000 Hz << rate_shift
 //==============================================================================
 
 void function_scheduler(void) {
- 
-    static uint16 counter_calibration = DIV_INIT_VALUE;
-    
-    // Start ADC Conversion, SOC = 1
 
-    timer_value0 = (uint32)MY_TIMER_ReadCounter();
-    
-    ADC_SOC_Write(0x01); 
-    
-    // Check Interrupt 
+    uint8 CYDATA i;
+    uint32 CYDATA start;
+    struct st_meas CYXDATA * CYDATA meas_swap;
+
+    // Restart cycle timer
+
+    MY_TIMER_WriteCounter(MY_TIMER_START);
+    timer_value0 = MY_TIMER_START;
+
+    // Latch the conversions started last cycle, whose DMA transfer completed
+    // meanwhile, and start the next ones in the other buffer. The last
+    // conversion of a cycle starts before its last task, so none is running
+    // here.
 
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+    if (ADC_STATUS_Read()) {
+        adc_idx = adc_fill_idx;
+        adc_fill_idx ^= 1;
+        adc_ready = TRUE;
     }
-  
-    //---------------------------------- Get Encoders
 
-    encoder_reading(0); 
-    
-    // Check Interrupt     
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
-    }   
-    
-    encoder_reading(1);
-    
-    // Check Interrupt 
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+    // Re-arm the DMA on the first sample of the buffer to fill, so that it
+    // follows adc_fill_idx: left on the TD ring, a conversion lost or in
+    // excess would shift the ring against it for good. An incomplete buffer
+    // is filled again from its start.
+
+    CyDmaChDisable(DMA_Chan);
+    CyDmaChSetInitialTd(DMA_Chan, DMA_TD[adc_fill_idx]);
+    CyDmaChEnable(DMA_Chan, 1);
+
+    adc_sign[adc_fill_idx][0] = pwm_sign[0];
+    adc_sign[adc_fill_idx][1] = pwm_sign[1];
+
+    adc_soc_cnt = 0;
+
+    //---------------------------------- Run Tasks
+
+    for (i = 0; i < NUM_OF_TASKS; i++) {
+
+        // ADC conversions, spaced by the tasks
+        adc_trigger(NUM_OF_TASKS + 1 - i);
+
+        // Preemption point
+        comm_service();
+
+        start = (uint32)MY_TIMER_ReadCounter();
+
+        // Skip task if it is too late to run it in this cycle
+        if (tasks[i].deadline && ((MY_TIMER_START - start) > tasks[i].deadline)) {
+            tasks[i].misses++;
+            continue;
+        }
+
+        task_run(i);
+
+        tasks[i].exec = start - (uint32)MY_TIMER_ReadCounter();
+        if (tasks[i].budget && (tasks[i].exec > tasks[i].budget))
+            tasks[i].overruns++;
     }
+
+    adc_trigger(1);
+
+    comm_service();
+   
+    //---------------------------------- Update States
     
+    // k measurements become k-1, next cycle writes over the k-1 buffer
+    meas_swap     = g_meas_ptr;
+    g_meas_ptr    = g_measOld_ptr;
+    g_measOld_ptr = meas_swap;
+
+    // Load k+1 state, k references become k-1
+    ref_update();
+
+    timer_value = (uint32)MY_TIMER_ReadCounter();
+}
+
+//==============================================================================
+//                                                              SCHEDULER TIMING
+//==============================================================================
+// Convert tasks and communication time limits from % of the control cycle to
+// MY_TIMER counts, using the cycle length measured in main
+//==============================================================================
+
+void scheduler_timing(void) {
+
+    uint8 CYDATA i;
+
+    comm_deadline = PERCENT_OF_CYCLE(c_mem.comm_deadline);
+    comm_slice    = PERCENT_OF_CYCLE(COMM_SLICE);
+
+    for (i = NUM_OF_TASKS; i--;) {
+        tasks[i].deadline = PERCENT_OF_CYCLE(tasks[i].deadline_pct);
+        tasks[i].budget   = PERCENT_OF_CYCLE(tasks[i].budget_pct);
+    }
+}
+
+//==============================================================================
+//                                                                 CONTROL SETUP
+//==============================================================================
+// Apply main frequency, position loop divider and control mode stored in
+// c_mem. Must be called every time c_mem changes and after PACER_TIMER has
+// been started, since PACER_TIMER_Start() reloads the period set in the
+// schematic (1 kHz)
+//==============================================================================
+
+void control_setup(void) {
+
+    uint8 CYDATA i;
+    int8 CYDATA pos_shift;                  // position loops frequency = 1 kHz << pos_shift
+    float mult;
+
+    for (rate_shift = 0; (1 << rate_shift) < c_mem.base_rate; rate_shift++);
+    for (pos_div_shift = 0; (1 << pos_div_shift) < c_mem.pos_div; pos_div_shift++);
+
+    pos_shift = rate_shift - pos_div_shift;
+
+    // Reference slew rate, max steps are given per ms in the motors resolution
+    for (i = NUM_OF_MOTORS; i--;) {
+        ref_step_pos[i] = (c_mem.max_step_pos << c_mem.res[i]) >> rate_shift;
+        if (c_mem.max_step_pos && !ref_step_pos[i])
+            ref_step_pos[i] = 1;
+
+        ref_step_neg[i] = -((-c_mem.max_step_neg << c_mem.res[i]) >> rate_shift);
+        if (c_mem.max_step_neg && !ref_step_neg[i])
+            ref_step_neg[i] = -1;
+    }
+
+    // Measurement multipliers, applied in fixed point by encoder_reading().
+    // Largest shift keeping abs(m_mult_mul) below 2^30.
+    m_mult_active = 0;
+    for (i = NUM_OF_SENSORS; i--;) {
+        mult = (c_mem.m_mult[i] < 0) ? -c_mem.m_mult[i] : c_mem.m_mult[i];
+        for (m_mult_shift[i] = 0; (m_mult_shift[i] < 30) && (mult < 536870912.0); m_mult_shift[i]++)
+            mult *= 2;
+
+        m_mult_mul[i] = (int32)(c_mem.m_mult[i] * (float)(1L << m_mult_shift[i]));
+
+        if (c_mem.m_mult[i] != 1.0)
+            m_mult_active |= (0x01 << i);
+    }
+
+    // Gains are tuned at 1 kHz: scale integral actions, and integral limits
+    // accordingly, with the loop frequency. Current derivative actions are
+    // computed on one main cycle differences and scale with the main
+    // frequency, position ones act on velocity in ticks/ms
+
+    ctrl_deflection = FALSE;
+
+    switch(c_mem.control_mode) {
+        case DEFLECTION_CONTROL:
+            ctrl_deflection = TRUE;
+        case CONTROL_ANGLE:
+            control_kernel = KERNEL_POSITION;
+
+            gains.k_p = c_mem.k_p;
+            gains.k_i = RATE_SCALE(c_mem.k_i, -pos_shift);
+            gains.k_d = c_mem.k_d;
+            gains.k_vff = c_mem.k_vff;
+            gains.k_aff = c_mem.k_aff;
+            gains.pos_sat = RATE_SCALE(c_mem.pos_int_limit, pos_shift);
+            break;
+
+        case DEFL_CURRENT_CONTROL:
+            ctrl_deflection = TRUE;
+        case CURR_AND_POS_CONTROL:
+            control_kernel = KERNEL_CASCADE;
+
+            gains.k_p   = c_mem.k_p_dl;
+            gains.k_i   = RATE_SCALE(c_mem.k_i_dl, -pos_shift);
+            gains.k_d   = c_mem.k_d_dl;
+            gains.k_p_c = c_mem.k_p_c_dl;
+            gains.k_i_c = RATE_SCALE(c_mem.k_i_c_dl, -rate_shift);
+            gains.k_d_c = RATE_SCALE(c_mem.k_d_c_dl, rate_shift);
+            gains.k_vff = c_mem.k_vff_dl;
+            gains.k_aff = c_mem.k_aff_dl;
+
+            // Each integral action must not exceed the range of its own loop
+            // output, current limit for the outer loop and PWM range for the
+            // inner one
+            gains.pos_sat = RATE_SCALE(c_mem.pos_int_limit, pos_shift);
+            if (((gains.k_i >> 8) > 0) && ((((int32)c_mem.current_limit << 8) / (gains.k_i >> 8)) < gains.pos_sat))
+                gains.pos_sat = ((int32)c_mem.current_limit << 8) / (gains.k_i >> 8);
+
+            curr_sat_setup();
+            break;
+
+        case CONTROL_CURRENT:
+            control_kernel = KERNEL_CURRENT;
+
+            gains.k_p_c = c_mem.k_p_c;
+            gains.k_i_c = RATE_SCALE(c_mem.k_i_c, -rate_shift);
+            gains.k_d_c = RATE_SCALE(c_mem.k_d_c, rate_shift);
+            gains.curr_sat = RATE_SCALE(c_mem.curr_int_limit, rate_shift);
+            break;
+
+        case CONTROL_PWM:
+            control_kernel = KERNEL_PWM;
+            break;
+
+        default:
+            control_kernel = KERNEL_OFF;
+            break;
+    }
+
+    gains_lim_setup();
+
+    PACER_TIMER_WritePeriod(((PACER_TIMER_INIT_PERIOD + 1) >> rate_shift) - 1);
+
+    pos_loop_cnt = DIV_INIT_VALUE;
+}
+
+// Current integral limit of the cascade, within the PWM range on the current
+// integral gain in use
+
+static void curr_sat_setup(void) {
+
+    gains.curr_sat = RATE_SCALE(c_mem.curr_int_limit, rate_shift);
+    if (((gains.k_i_c >> 8) > 0) && ((((int32)PWM_MAX_VALUE << 8) / (gains.k_i_c >> 8)) < gains.curr_sat))
+        gains.curr_sat = ((int32)PWM_MAX_VALUE << 8) / (gains.k_i_c >> 8);
+}
+
+// Operand limits of the plain multiplications of the loops, on the gains in
+// use
+
+static void gains_lim_setup(void) {
+
+    gains.lim_p   = fxp_lim(gains.k_p);
+    gains.lim_i   = fxp_lim(gains.k_i);
+    gains.lim_d   = fxp_lim(gains.k_d);
+    gains.lim_p_c = fxp_lim(gains.k_p_c);
+    gains.lim_i_c = fxp_lim(gains.k_i_c);
+    gains.lim_d_c = fxp_lim(gains.k_d_c);
+    gains.lim_vff = fxp_lim(gains.k_vff);
+    gains.lim_aff = fxp_lim(gains.k_aff);
+}
+
+//==============================================================================
+//                                                              REFERENCE UPDATE
+//==============================================================================
+// Load k+1 references limiting their change per cycle to max_step_pos and
+// max_step_neg (0 = no limit). References are loaded without limits while
+// motors are off, so that activation starts from the references set with it.
+// They are written in the k-1 buffer, which then becomes the k one. g_refNew
+// is written only by the packets parser, which runs in this same thread (the
+// RS485 ISR just flags received data), so it is always read whole.
+// Feedforward velocity and acceleration are those given by the host or, if
+// none, the filtered derivatives of the limited references.
+//==============================================================================
+
+static void ref_update(void) {
+
+    uint8 CYDATA i;
+    int32 CYDATA step;
+    int32 CYDATA vel;
+    int32 CYDATA acc;
+    struct st_ref CYXDATA * CYDATA ref_swap;
+
+    for (i = NUM_OF_MOTORS; i--;) {
+
+        step = g_refNew.pos[i] - g_ref.pos[i];
+
+        if (g_ref.onoff) {
+            if (ref_step_pos[i] && (step > ref_step_pos[i]))
+                step = ref_step_pos[i];
+            else {
+                if (ref_step_neg[i] && (step < ref_step_neg[i]))
+                    step = ref_step_neg[i];
+            }
+        }
+
+        g_refOld.pos[i] = g_ref.pos[i] + step;
+
+        if (g_refNew.ff_ext) {
+            g_refOld.vel[i] = g_refNew.vel[i];
+            g_refOld.acc[i] = g_refNew.acc[i];
+        }
+        else {
+            if (g_ref.onoff) {
+                vel = fxp_add(fxp_shl(step, rate_shift), -g_ref.vel[i]);
+                vel = g_ref.vel[i] + (vel >> FF_FILTER_SHIFT);
+                acc = fxp_add(fxp_shl(vel - g_ref.vel[i], 8 + rate_shift), -g_ref.acc[i]);
+                g_refOld.vel[i] = vel;
+                g_refOld.acc[i] = g_ref.acc[i] + (acc >> FF_FILTER_SHIFT);
+            }
+            else {
+                g_refOld.vel[i] = 0;
+                g_refOld.acc[i] = 0;
+            }
+        }
+    }
+
+    g_refOld.ff_ext = g_refNew.ff_ext;
+
+    g_refOld.onoff = g_refNew.onoff;
+
+    ref_swap     = g_ref_ptr;
+    g_ref_ptr    = g_refOld_ptr;
+    g_refOld_ptr = ref_swap;
+}
+
+//==============================================================================
+//                                                                   ADC TRIGGER
+//==============================================================================
+// Called at points_left points of the cycle, starts one of the
+// ADC_OVERSAMPLING conversions if the PWM counter is within ADC_PWM_WINDOW
+// after ADC_PWM_PHASE, so that currents are sampled at the same point of
+// their ripple. Out of phase, it starts it anyway when the points left are
+// just enough for the conversions left. Never waits: starting the conversions
+// from the PWM terminal count in hardware would need a schematic change.
+//==============================================================================
+
+static void adc_trigger(const uint8 points_left) {
+
+    if (adc_soc_cnt >= ADC_OVERSAMPLING)
+        return;
+
+    if (((uint16)(PWM_MOTORS_ReadCounter() - ADC_PWM_PHASE) >= ADC_PWM_WINDOW) &&
+        ((ADC_OVERSAMPLING - adc_soc_cnt) < points_left))
+        return;
+
+    ADC_SOC_Write(0x01);
+    adc_soc_cnt++;
+}
+
+//==============================================================================
+//                                                         COMMUNICATION SERVICE
+//==============================================================================
+// Preemption point: parse RS485 data for at most comm_slice counts, never
+// beyond the communication deadline
+//==============================================================================
+
+void comm_service(void) {
+
+    uint32 CYDATA limit;
+
+    if (!interrupt_flag)
+        return;
+
+    interrupt_flag = FALSE;
+
+    limit = MY_TIMER_START - (uint32)MY_TIMER_ReadCounter() + comm_slice;
+    if (limit > comm_deadline)
+        limit = comm_deadline;
+
+    interrupt_manager(limit);
+}
+
+//==============================================================================
+//                                                                         TASKS
+//==============================================================================
+
+static void task_run(const uint8 id) {
+
+    switch (id) {
+        case TASK_ENCODERS:
+            task_encoders();
+            break;
+        case TASK_ANALOG:
+            analog_read_end();
+            break;
+        case TASK_CONTROL:
+            task_control();
+            break;
+        case TASK_TRAJECTORY:
+            task_trajectory();
+            break;
+        case TASK_CALIBRATION:
+            task_calibration();
+            break;
+    }
+}
+
+static void task_encoders(void) {
+
+    encoder_reading(0);
+    encoder_reading(1);
     encoder_reading(2);
-    
-    // Check Interrupt 
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+}
+
+static void task_control(void) {
+
+    // Position loops run at the main frequency divided by c_mem.pos_div
+    pos_loop_tick = FALSE;
+    if (!(--pos_loop_cnt)) {
+        pos_loop_cnt = c_mem.pos_div;
+        pos_loop_tick = TRUE;
     }
 
-    //---------------------------------- Control Motors
-    
-    motor_control(0);
+    if (c_mem.input_mode == INPUT_MODE_ENCODER3)
+        ctrl_input_encoder3();
 
-    // Check Interrupt 
+    if (g_fra.status == FRA_RUNNING)
+        fra_update();
+
+    ctrl_kernel_run();
+
+    if (tune_loop)
+        tune_update();
+}
 
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+static void task_trajectory(void) {
+
+    uint8 CYDATA i;
+    int32 CYDATA tau;                       // Q15
+    int32 CYDATA tau2;
+    int32 CYDATA tau3;
+    int32 CYDATA s;                         // position along segment, Q15
+    int32 CYDATA h10 = 0;                   // Hermite tangents weights, Q15
+    int32 CYDATA h11 = 0;
+
+    if (!traj_ticks) {
+        if (!g_traj.count) {
+            // Hold last point
+            if (g_traj.running && !(traj_mode & TRAJ_END))
+                g_traj.underruns++;
+            g_traj.running = FALSE;
+            return;
+        }
+        traj_segment_start();
     }
-    
-    motor_control(1);
-    
-    // Check Interrupt 
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+
+    traj_ticks--;
+    traj_tau += traj_tau_step;
+    tau = traj_ticks ? (int32)(traj_tau >> 16) : 32768;
+
+    tau2 = (tau * tau) >> 15;
+    tau3 = (tau2 * tau) >> 15;
+
+    switch(traj_mode & ~TRAJ_END) {
+        case TRAJ_HERMITE:
+            s   = 3 * tau2 - 2 * tau3;
+            h10 = tau3 - 2 * tau2 + tau;
+            h11 = tau3 - tau2;
+            break;
+
+        case TRAJ_MIN_JERK:
+            // 10 tau^3 - 15 tau^4 + 6 tau^5
+            s = (tau3 * ((327680 - 15 * tau + 6 * tau2) >> 3)) >> 12;
+            break;
+
+        default:
+            s = tau;
+            break;
+    }
+
+    for (i = NUM_OF_MOTORS; i--;) {
+
+        g_refNew.pos[i] = traj_p0[i] + mul_q15(traj_p1[i] - traj_p0[i], s);
+
+        if (h10 || h11)
+            g_refNew.pos[i] += mul_q15(traj_m0[i], h10) + mul_q15(traj_m1[i], h11);
+
+        // position limit
+        if (c_mem.pos_lim_flag) {
+            if (g_refNew.pos[i] < c_mem.pos_lim_inf[i])
+                g_refNew.pos[i] = c_mem.pos_lim_inf[i];
+            if (g_refNew.pos[i] > c_mem.pos_lim_sup[i])
+                g_refNew.pos[i] = c_mem.pos_lim_sup[i];
+        }
+    }
+}
+
+static void task_calibration(void) {
+
+    // At the main frequency, RS485 stays enabled
+    if (calibration_flag != STOP)
+        calibration();
+}
+
+
+//==============================================================================
+//                                                                    TRAJECTORY
+//==============================================================================
+
+// Queue a waypoint, dropped if the queue is full
+
+void traj_push(const int32 *pos, const uint16 dt, const uint8 mode) {
+
+    uint8 CYDATA i;
+
+    if (g_traj.count == TRAJ_FIFO_SIZE) {
+        g_traj.dropped++;
+        return;
+    }
+
+    for (i = NUM_OF_MOTORS; i--;)
+        g_traj.fifo[g_traj.head].pos[i] = pos[i];
+    g_traj.fifo[g_traj.head].dt = dt;
+    g_traj.fifo[g_traj.head].mode = mode;
+
+    g_traj.head = (g_traj.head + 1) & (TRAJ_FIFO_SIZE - 1);
+    g_traj.count++;
+}
+
+// Drop queued waypoints and stop on the current references
+
+void traj_flush(void) {
+
+    g_traj.head = 0;
+    g_traj.tail = 0;
+    g_traj.count = 0;
+
+    traj_ticks = 0;
+    traj_mode = TRAJ_END;
+    g_traj.running = FALSE;
+}
+
+// Start interpolating towards the next queued waypoint
+
+static void traj_segment_start(void) {
+
+    uint8 CYDATA i;
+    uint16 CYDATA dt_prev;
+    uint16 CYDATA dt_next = 0;
+    int32 CYDATA prev;
+    struct st_traj_point *point = &g_traj.fifo[g_traj.tail];
+    struct st_traj_point *next;
+
+    // From last reached waypoint or, if stopped, from current references
+    dt_prev = g_traj.running ? traj_dt : 0;
+    traj_dt = point->dt ? point->dt : 1;
+    traj_mode = point->mode;
+
+    g_traj.tail = (g_traj.tail + 1) & (TRAJ_FIFO_SIZE - 1);
+    g_traj.count--;
+
+    next = &g_traj.fifo[g_traj.tail];
+    if (g_traj.count)
+        dt_next = next->dt ? next->dt : 1;
+
+    for (i = NUM_OF_MOTORS; i--;) {
+
+        if (g_traj.running) {
+            prev = traj_p0[i];
+            traj_p0[i] = traj_p1[i];
+        }
+        else
+            prev = traj_p0[i] = g_refNew.pos[i];
+
+        traj_p1[i] = point->pos[i];
+
+        // Catmull-Rom tangents on non uniform times, zero at trajectory ends
+        traj_m0[i] = 0;
+        traj_m1[i] = 0;
+        if ((traj_mode & ~TRAJ_END) == TRAJ_HERMITE) {
+            if (dt_prev)
+                traj_m0[i] = mul_q15(traj_p1[i] - prev,
+                    ((uint32)traj_dt << 15) / (dt_prev + traj_dt));
+            if (dt_next)
+                traj_m1[i] = mul_q15(next->pos[i] - traj_p0[i],
+                    ((uint32)traj_dt << 15) / (traj_dt + dt_next));
+        }
+    }
+
+    traj_ticks = (uint32)traj_dt << rate_shift;
+    traj_tau_step = 0x80000000 / traj_ticks;
+    traj_tau = 0;
+    g_traj.running = TRUE;
+
+    // Feedforward from the interpolated references
+    g_refNew.ff_ext = FALSE;
+}
+
+//==============================================================================
+//                                                                MOTORS CONTROL
+//==============================================================================
+// One kernel for each control mode, bound by control_setup(). Every kernel
+// computes both motors and ends in the common output stage.
+//==============================================================================
+
+//------------------------------------------------------------------     input
+
+static void ctrl_input_encoder3(void) {
+
+    uint8 CYDATA i;
+
+    // --------------- USE THIRD ENCODER AS INPUT FOR BOTH MOTORS --------------
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+
+        g_ref.pos[i] = g_measOld.pos[2];
+
+        // position limit
+        if (c_mem.pos_lim_flag) {
+            if (g_ref.pos[i] < c_mem.pos_lim_inf[i]) 
+                g_ref.pos[i] = c_mem.pos_lim_inf[i];
+            if (g_ref.pos[i] > c_mem.pos_lim_sup[i]) 
+                g_ref.pos[i] = c_mem.pos_lim_sup[i];
+        }
+    }
+}
+
+//-----------------------------------------------------------------     output
+
+static void ctrl_output(void) {
+
+    uint8 CYDATA i;
+    uint8 CYDATA direction = 0;
+
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+
+        // frequency response excitation, on the loop output
+        if (fra_pwm[i] != 0)
+            pwm_out[i] = fxp_add(pwm_out[i], fra_pwm[i]);
+
+        if (pwm_out[i] >= 0)
+            direction |= (0x01 << i);
+
+        // deadband offset on closed loop outputs
+        if (c_mem.control_mode != CONTROL_PWM) {
+            if (pwm_out[i] > 0)
+                pwm_out[i] = fxp_add(pwm_out[i], c_mem.pwm_dead);
+            if (pwm_out[i] < 0)
+                pwm_out[i] = fxp_add(pwm_out[i], -(int32)c_mem.pwm_dead);
+        }
+
+        // abs(pwm_out) must be lower or equal to PWM_MAX_VALUE
+        pwm_sat[i] = 0;
+        if (pwm_out[i] >= ((int32)PWM_MAX_VALUE << PWM_OUT_SHIFT)) {
+            pwm_out[i] = (int32)PWM_MAX_VALUE << PWM_OUT_SHIFT;
+            pwm_sat[i] = 1;
+        }
+        if (pwm_out[i] <= -((int32)PWM_MAX_VALUE << PWM_OUT_SHIFT)) {
+            pwm_out[i] = -((int32)PWM_MAX_VALUE << PWM_OUT_SHIFT);
+            pwm_sat[i] = -1;
+        }
+
+        // remap pwm_out on the compare range and on pwm_limit based on input
+        // tension to have maximum 8 volts
+        if (c_mem.control_mode != CONTROL_PWM)
+            pwm_out[i] = (pwm_out[i] * pwm_scale) >> PWM_SCALE_SHIFT;
+        else
+            pwm_out[i] = (pwm_out[i] * PWM_SCALE_FULL) >> PWM_SCALE_SHIFT;
+
+        pwm_out[i] = FXP_SAT(pwm_out[i], PWM_PERIOD);
+
+        pwm_sign[i] = SIGN(pwm_out[i]);
+    }
+
+    // drive direction and pwm duty cycle
+    MOTOR_DIR_Write(direction);
+
+    PWM_MOTORS_WriteCompare1(abs(pwm_out[0]));
+    PWM_MOTORS_WriteCompare2(abs(pwm_out[1]));
+}
+
+//-----------------------------------------------------------     kernel dispatch
+
+static void ctrl_kernel_run(void) {
+
+    switch (control_kernel) {
+        case KERNEL_POSITION:
+            ctrl_position();
+            break;
+        case KERNEL_CASCADE:
+            ctrl_cascade();
+            break;
+        case KERNEL_CURRENT:
+            ctrl_current();
+            break;
+        case KERNEL_PWM:
+            ctrl_pwm();
+            break;
+        case KERNEL_FRIC_IDENT:
+            ctrl_friction_ident();
+            break;
+        case KERNEL_AUTOTUNE:
+            ctrl_autotune();
+            break;
+        default:
+            ctrl_off();
+            break;
+    }
+}
+
+//---------------------------------------------------------     position control
+
+static void ctrl_position(void) {
+
+    uint8 CYDATA i;
+    int32 CYDATA pos_error;
+    int32 CYDATA pwm_input;
+
+    // Position loop runs at the position loop frequency
+    if (!pos_loop_tick)
+        return;
+
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+
+        // position error
+        pos_error = g_ref.pos[i] + fra_ref[i] - g_meas.pos[i];
+
+        //for deflection control the shaft position must be summed to reference
+        if (ctrl_deflection)
+            pos_error += g_meas.pos[2];
+
+        // error sum for integral, not while winding up
+        if (!WINDS_UP(pwm_sat[i], pos_error))
+            pos_error_sum[i] = fxp_add(pos_error_sum[i], pos_error);
+
+        //anti wind-up
+        if (pos_error_sum[i] > gains.pos_sat)
+            pos_error_sum[i] = gains.pos_sat;
+        else{
+            if (pos_error_sum[i] < -gains.pos_sat)
+                pos_error_sum[i] = -gains.pos_sat;
+        }
+
+        // pwm_input init
+        pwm_input = 0;
+
+        // Proportional
+        if (gains.k_p != 0)
+            pwm_input = FXP_MUL_LIM(gains.k_p, pos_error, gains.lim_p, 16 - PWM_OUT_SHIFT);
+
+        // Integral
+        if (gains.k_i != 0)
+            pwm_input = FXP_MAC_LIM(pwm_input, gains.k_i, pos_error_sum[i], gains.lim_i, 16 - PWM_OUT_SHIFT);
+
+        // Derivative, on estimated velocity
+        if (gains.k_d != 0)
+            pwm_input = FXP_MAC_LIM(pwm_input, -gains.k_d, g_meas.vel[i], gains.lim_d, 16 - PWM_OUT_SHIFT);
+
+        // Feedforward, on reference velocity and acceleration
+        if (gains.k_vff != 0)
+            pwm_input = FXP_MAC_LIM(pwm_input, gains.k_vff, g_ref.vel[i], gains.lim_vff, 16 - PWM_OUT_SHIFT);
+        if (gains.k_aff != 0)
+            pwm_input = FXP_MAC_LIM(pwm_input, gains.k_aff, g_ref.acc[i], gains.lim_aff, 16 - PWM_OUT_SHIFT);
+
+        // Coulomb friction, in the direction of the reference velocity and
+        // not at rest, so that it does not chatter on the position error
+        if (g_ref.vel[i] > FRIC_VEL_DEAD)
+            pwm_input = fxp_add(pwm_input, c_mem.fric_coul[i][0]);
+        if (g_ref.vel[i] < -FRIC_VEL_DEAD)
+            pwm_input = fxp_add(pwm_input, -(int32)c_mem.fric_coul[i][1]);
+
+        // Viscous friction, on reference velocity
+        if (c_mem.fric_visc[i] != 0)
+            pwm_input = FXP_MAC(pwm_input, c_mem.fric_visc[i], g_ref.vel[i], 16 - PWM_OUT_SHIFT);
+
+        pwm_out[i] = pwm_input;
+    }
+
+    ctrl_output();
+}
+
+//----------------------------------------------------------     cascade control
+
+static void ctrl_cascade(void) {
+
+    uint8 CYDATA i;
+    int32 CYDATA pos_error;
+    int32 CYDATA curr_ref;
+    int32 CYDATA curr_error;
+    int32 CYDATA curr_diff;
+    int32 CYDATA pwm_input;
+
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+
+        // ------ position PID control, outer loop -----
+
+        if (pos_loop_tick) {
+
+            pos_error = g_ref.pos[i] + fra_ref[i] - g_meas.pos[i];
+
+            //for deflection control the shaft position must be summed to reference
+            if (ctrl_deflection)
+                pos_error += g_meas.pos[2];
+
+            // not while current or PWM are saturated in the same direction
+            if (!WINDS_UP(casc_sat[i], pos_error) && !WINDS_UP(pwm_sat[i], pos_error))
+                pos_error_sum[i] = fxp_add(pos_error_sum[i], pos_error);
+
+            // error_sum saturation, integral action within current limit
+            if (pos_error_sum[i] > gains.pos_sat)
+                pos_error_sum[i] = gains.pos_sat;
+            else{
+                if (pos_error_sum[i] < -gains.pos_sat)
+                    pos_error_sum[i] = -gains.pos_sat;
+            }
+
+            curr_ref = 0;
+
+            // Proportional
+            if (gains.k_p != 0)
+                curr_ref = FXP_MUL_LIM(gains.k_p, pos_error, gains.lim_p, 16);
+
+            // Integral
+            if (gains.k_i != 0)
+                curr_ref = FXP_MAC_LIM(curr_ref, gains.k_i, pos_error_sum[i], gains.lim_i, 16);
+
+            // Derivative, on estimated velocity
+            if (gains.k_d != 0)
+                curr_ref = FXP_MAC_LIM(curr_ref, -gains.k_d, g_meas.vel[i], gains.lim_d, 16);
+
+            // Feedforward, on reference velocity and acceleration
+            if (gains.k_vff != 0)
+                curr_ref = FXP_MAC_LIM(curr_ref, gains.k_vff, g_ref.vel[i], gains.lim_vff, 16);
+            if (gains.k_aff != 0)
+                curr_ref = FXP_MAC_LIM(curr_ref, gains.k_aff, g_ref.acc[i], gains.lim_aff, 16);
+
+            // Relay in place of the outer loop while autotuning it
+            if (tune_loop == TUNE_LOOP_CASC)
+                curr_ref = tune_relay(i, pos_error);
+
+            // saturate max current
+            casc_sat[i] = 0;
+            if (curr_ref >= c_mem.current_limit) {
+                curr_ref = c_mem.current_limit;
+                casc_sat[i] = 1;
+            }
+            if (curr_ref <= -c_mem.current_limit) {
+                curr_ref = -c_mem.current_limit;
+                casc_sat[i] = -1;
+            }
+
+            casc_curr_ref[i] = curr_ref;
+        }
+        else
+            curr_ref = casc_curr_ref[i];
+
+        // ------ current PID control, inner loop -----
+
+        // current error and error sum, not while PWM is saturated
+        curr_error = curr_ref - g_meas.curr_loop[i];
+        if (!WINDS_UP(pwm_sat[i], curr_error))
+            curr_error_sum[i] = fxp_add(curr_error_sum[i], curr_error);
+
+        // error_sum saturation, integral action within PWM range
+        if (curr_error_sum[i] > gains.curr_sat)
+            curr_error_sum[i] = gains.curr_sat;
+        else{
+            if (curr_error_sum[i] < -gains.curr_sat)
+                curr_error_sum[i] = -gains.curr_sat;
+        }
+
+        pwm_input = 0;
+
+        // Proportional
+        if (gains.k_p_c != 0)
+            pwm_input = FXP_MUL_LIM(gains.k_p_c, curr_error, gains.lim_p_c, 16 - PWM_OUT_SHIFT);
+
+        // Integral
+        if (gains.k_i_c != 0)
+            pwm_input = FXP_MAC_LIM(pwm_input, gains.k_i_c, curr_error_sum[i], gains.lim_i_c, 16 - PWM_OUT_SHIFT);
+
+        // Derivative
+        if (gains.k_d_c != 0) {
+            curr_diff = g_measOld.curr_loop[i] - g_meas.curr_loop[i];
+            pwm_input = FXP_MAC_LIM(pwm_input, gains.k_d_c, curr_diff, gains.lim_d_c, 16 - PWM_OUT_SHIFT);
+        }
+
+        pwm_out[i] = pwm_input;
+    }
+
+    ctrl_output();
+}
+
+//----------------------------------------------------------     current control
+
+static void ctrl_current(void) {
+
+    uint8 CYDATA i;
+    int32 CYDATA curr_ref;
+    int32 CYDATA curr_error;
+    int32 CYDATA curr_diff;
+    int32 CYDATA pwm_input;
+
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+
+        // Current ref from pos ref
+        curr_ref = (g_ref.pos[i] + fra_ref[i]) >> g_mem.res[i];
+
+        // saturate max current
+        if (curr_ref > c_mem.current_limit)
+            curr_ref = c_mem.current_limit;
+        else {
+            if(curr_ref < -c_mem.current_limit)
+               curr_ref = -c_mem.current_limit;
+        }
+
+        // Current error
+        curr_error = curr_ref - g_meas.curr_loop[i];
+
+        // Error sum for integral, not while PWM is saturated
+        if (!WINDS_UP(pwm_sat[i], curr_error))
+            curr_error_sum[i] = fxp_add(curr_error_sum[i], curr_error);
+
+        //anti wind-up
+        if (curr_error_sum[i] > gains.curr_sat)
+            curr_error_sum[i] = gains.curr_sat;
+        else {
+            if (curr_error_sum[i] < -gains.curr_sat)
+                curr_error_sum[i] = -gains.curr_sat;
+        }
+
+        // pwm_input init
+        pwm_input = 0;
+
+        // Proportional
+        if (gains.k_p_c != 0)
+            pwm_input = FXP_MUL_LIM(gains.k_p_c, curr_error, gains.lim_p_c, 16 - PWM_OUT_SHIFT);
+
+        // Integral
+        if (gains.k_i_c != 0)
+            pwm_input = FXP_MAC_LIM(pwm_input, gains.k_i_c, curr_error_sum[i], gains.lim_i_c, 16 - PWM_OUT_SHIFT);
+
+        // Derivative
+        if (gains.k_d_c != 0) {
+            curr_diff = curr_error - prev_curr_err[i];
+            pwm_input = FXP_MAC_LIM(pwm_input, gains.k_d_c, curr_diff, gains.lim_d_c, 16 - PWM_OUT_SHIFT);
+        }
+
+        // Update measure
+        prev_curr_err[i] = curr_error;
+
+        pwm_out[i] = pwm_input;
+    }
+
+    ctrl_output();
+}
+
+//--------------------------------------------------------------     pwm control
+
+static void ctrl_pwm(void) {
+
+    // Direct PWM value
+    pwm_out[0] = (g_ref.pos[0] >> g_mem.res[0]) << PWM_OUT_SHIFT;
+    pwm_out[1] = (g_ref.pos[1] >> g_mem.res[1]) << PWM_OUT_SHIFT;
+
+    ctrl_output();
+}
+
+//-------------------------------------------------------------     unknown mode
+
+static void ctrl_off(void) {
+
+    pwm_out[0] = 0;
+    pwm_out[1] = 0;
+
+    ctrl_output();
+}
+
+//==============================================================================
+//                                                       FRICTION IDENTIFICATION
+//==============================================================================
+// Ramp the PWM of one motor at a time, in each direction, starting from rest,
+// until the motor moves by FRIC_IDENT_MOVE ticks. The PWM reached is the
+// breakaway one, loaded in g_mem.fric_coul[][] to be stored with the other
+// parameters (0 if the motor did not move within FRIC_IDENT_MAX). Runs in
+// place of the control kernel, bound again at the end. Only in position
+// modes, where the references can hold the positions reached. Deactivating
+// the motors aborts it, and nothing is loaded.
+//==============================================================================
+
+uint8 friction_ident_start(void) {
+
+    // Motors must be active and not calibrating
+    if (((g_ref.onoff & 0x03) != 0x03) || (calibration_flag != STOP) || tune_loop ||
+        (g_fra.status == FRA_RUNNING))
+        return FALSE;
+
+    switch(c_mem.control_mode) {
+        case CONTROL_ANGLE:
+        case DEFLECTION_CONTROL:
+        case CURR_AND_POS_CONTROL:
+        case DEFL_CURRENT_CONTROL:
+            break;
+
+        default:
+            return FALSE;
+    }
+
+    ident_step = 0;
+    ident_rest = (uint16)FRIC_IDENT_REST << rate_shift;
+    control_kernel = KERNEL_FRIC_IDENT;
+
+    return TRUE;
+}
+
+void friction_ident_abort(void) {
+
+    uint8 CYDATA i;
+
+    if (control_kernel != KERNEL_FRIC_IDENT)
+        return;
+
+    for (i = NUM_OF_MOTORS; i--;)
+        pos_error_sum[i] = 0;
+
+    control_setup();
+}
+
+static void ctrl_friction_ident(void) {
+
+    uint8 CYDATA i;
+    uint8 CYDATA motor = ident_step >> 1;
+    int32 CYDATA step;
+
+    pwm_out[0] = 0;
+    pwm_out[1] = 0;
+
+    // Motors deactivated
+    if ((g_ref.onoff & 0x03) != 0x03) {
+        friction_ident_abort();
+        ctrl_output();
+        return;
+    }
+
+    if (ident_rest) {
+        ident_rest--;
+        ident_pwm = 0;
+        ident_pos0 = g_meas.pos[motor];
+    }
+    else {
+        step = FRIC_IDENT_RAMP >> rate_shift;
+        ident_pwm += step ? step : 1;
+
+        if ((labs(g_meas.pos[motor] - ident_pos0) > FRIC_IDENT_MOVE) || (ident_pwm > FRIC_IDENT_MAX)) {
+
+            ident_coul[motor][ident_step & 0x01] = (ident_pwm > FRIC_IDENT_MAX) ? 0 : ident_pwm;
+
+            ident_pwm = 0;
+            ident_rest = (uint16)FRIC_IDENT_REST << rate_shift;
+
+            if (++ident_step == (NUM_OF_MOTORS << 1)) {
+
+                // Load the results and hold the positions reached,
+                // deflection references are relative to the shaft
+                for (i = NUM_OF_MOTORS; i--;) {
+                    g_mem.fric_coul[i][0] = ident_coul[i][0];
+                    g_mem.fric_coul[i][1] = ident_coul[i][1];
+                    g_ref.pos[i] = g_meas.pos[i];
+                    if (ctrl_deflection)
+                        g_ref.pos[i] -= g_meas.pos[2];
+                    g_refNew.pos[i] = g_ref.pos[i];
+                    pos_error_sum[i] = 0;
+                }
+
+                control_setup();
+            }
+        }
+
+        pwm_out[motor] = (ident_step & 0x01) ? -ident_pwm : ident_pwm;
+    }
+
+    ctrl_output();
+}
+
+//==============================================================================
+//                                                              RELAY AUTOTUNING
+//==============================================================================
+// Replace the loop under test with a relay, with hysteresis, on its error
+// until every motor has gone through TUNE_SKIP + TUNE_PERIODS oscillation
+// periods. Amplitude a and period Tu of the oscillation give the ultimate
+// gain Ku = 4 d / (pi a) of a relay of amplitude d, and PID gains follow the
+// Ziegler-Nichols "some overshoot" rule: Kp = Ku / 3, Ti = Tu / 2,
+// Td = Tu / 3. The motor with the lowest Ku is used. Gains are staged in
+// g_mem and, if requested, applied to c_mem too.
+// Position and current loops are relayed on PWM by ctrl_autotune(), in
+// place of the control kernel, current ones around zero current. In cascade
+// modes the current loop is tuned first, then the outer loop is relayed on
+// the current reference inside ctrl_cascade(), using the new current gains.
+//==============================================================================
+
+uint8 autotune_start(const uint8 apply) {
+
+    // Motors must be active, not calibrating nor identifying friction
+    if (((g_ref.onoff & 0x03) != 0x03) || (calibration_flag != STOP) ||
+        (control_kernel == KERNEL_FRIC_IDENT) || tune_loop || (g_fra.status == FRA_RUNNING))
+        return FALSE;
+
+    switch(c_mem.control_mode) {
+        case CONTROL_ANGLE:
+        case DEFLECTION_CONTROL:
+            tune_loop_start(TUNE_LOOP_POS);
+            break;
+
+        case CONTROL_CURRENT:
+        case CURR_AND_POS_CONTROL:
+        case DEFL_CURRENT_CONTROL:
+            tune_loop_start(TUNE_LOOP_CURR);
+            break;
+
+        default:
+            return FALSE;
+    }
+
+    tune_apply = apply;
+    tune_status = TUNE_RUNNING;
+
+    return TRUE;
+}
+
+static void tune_loop_start(const uint8 loop) {
+
+    uint8 CYDATA i;
+
+    tune_loop = loop;
+    tune_time = 0;
+    tune_amp = (loop == TUNE_LOOP_CASC) ? TUNE_RELAY_CURR : ((int32)TUNE_RELAY_PWM << PWM_OUT_SHIFT);
+    tune_hyst = (loop == TUNE_LOOP_CURR) ? TUNE_CURR_HYST : TUNE_POS_HYST;
+
+    for (i = NUM_OF_MOTORS; i--;) {
+        tune_out[i] = 1;
+        tune_n[i] = 0;
+        tune_period[i] = 0;
+        tune_pp[i] = 0;
+    }
+
+    control_kernel = (loop == TUNE_LOOP_CASC) ? KERNEL_CASCADE : KERNEL_AUTOTUNE;
+}
+
+// Relay output for the error of motor i, measuring the oscillation. Each
+// period ends on a switch to positive output.
+
+static int32 tune_relay(const uint8 i, const int32 error) {
+
+    if (error > tune_max[i])
+        tune_max[i] = error;
+    if (error < tune_min[i])
+        tune_min[i] = error;
+
+    if ((tune_out[i] < 0) && (error > tune_hyst)) {
+        tune_out[i] = 1;
+
+        if (tune_n[i] <= TUNE_SKIP + TUNE_PERIODS) {
+            if (tune_n[i] > TUNE_SKIP) {
+                tune_period[i] += tune_time - tune_t0[i];
+                tune_pp[i] += tune_max[i] - tune_min[i];
+            }
+            tune_n[i]++;
+        }
+
+        tune_t0[i] = tune_time;
+        tune_max[i] = error;
+        tune_min[i] = error;
+    }
+    else {
+        if ((tune_out[i] > 0) && (error < -tune_hyst))
+            tune_out[i] = -1;
     }
 
-    //---------------------------------- Read conversion buffer - LOCK function
+    return (tune_out[i] > 0) ? tune_amp : -tune_amp;
+}
 
-    analog_read_end();
+// Once per main cycle, after the control kernel
 
-    //---------------------------------- Calibration 
+static void tune_update(void) {
 
-    // Divider 100, freq = 10 Hz
-    if (!(calibration_flag == STOP)) {
-        if (counter_calibration == CALIBRATION_DIV) {
-            calibration();
-            counter_calibration = 0;
-        }
-        counter_calibration++;
-    }
-    // Check Interrupt 
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
-    }
-   
-    //---------------------------------- Update States
-    
-    // Load k-1 state
-    memcpy( &g_measOld, &g_meas, sizeof(g_meas) );
-    memcpy( &g_refOld, &g_ref, sizeof(g_ref) );
+    uint8 CYDATA i;
 
-    // Load k+1 state
-    memcpy( &g_ref, &g_refNew, sizeof(g_ref) );
+    tune_time++;
 
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+    // Motors deactivated or no oscillation
+    if (((g_ref.onoff & 0x03) != 0x03) || (tune_time > ((uint32)TUNE_TIMEOUT << rate_shift))) {
+        tune_loop_end(FALSE);
+        return;
     }
 
-    //CyDelayUs(100);
-
-    timer_value = (uint32)MY_TIMER_ReadCounter();
-    MY_TIMER_WriteCounter(5000000);
+    for (i = NUM_OF_MOTORS; i--;)
+        if (tune_n[i] <= TUNE_SKIP + TUNE_PERIODS)
+            return;
 
+    tune_loop_end(TRUE);
 }
 
+static void tune_loop_end(const uint8 done) {
 
-//==============================================================================
-//                                                                MOTORS CONTROL
-//==============================================================================
+    uint8 CYDATA i;
+    uint8 CYDATA m = 0;
+    float ku;
+    float tu;
+    int32 *g_gains;
+    int32 *c_gains;
 
-void motor_control(const uint8 idx) {
-    
-    uint8 CYDATA index = idx;
- 
-    int32 CYDATA curr_ref;
+    for (i = 1; i < NUM_OF_MOTORS; i++)
+        if (tune_pp[i] > tune_pp[m])
+            m = i;
 
-    int32 CYDATA pwm_input = 0;
-    
-    int32 CYDATA pos_error;
-    int32 CYDATA curr_error;
-    int32 CYDATA defl_input[NUM_OF_MOTORS];
-    
-    int32 CYDATA k_p = c_mem.k_p;  
-    int32 CYDATA k_i = c_mem.k_i; 
-    int32 CYDATA k_d = c_mem.k_d; 
+    if (done && (tune_pp[m] > 0) && tune_period[m]) {
 
-    int32 CYDATA k_p_c = c_mem.k_p_c;  
-    int32 CYDATA k_i_c = c_mem.k_i_c; 
-    int32 CYDATA k_d_c = c_mem.k_d_c;   
+        // Ku on the motor with the largest oscillation, a = pp / 2, Tu [ms]
+        ku = (8.0 * TUNE_PERIODS / 3.14159) * ((tune_loop == TUNE_LOOP_CASC) ? TUNE_RELAY_CURR : TUNE_RELAY_PWM) / tune_pp[m];
+        tu = (float)tune_period[m] / ((uint16)TUNE_PERIODS << rate_shift);
 
-    int32 CYDATA k_p_dl = c_mem.k_p_dl;  
-    int32 CYDATA k_i_dl = c_mem.k_i_dl; 
-    int32 CYDATA k_d_dl = c_mem.k_d_dl; 
+        switch(tune_loop) {
+            case TUNE_LOOP_POS:
+                g_gains = &g_mem.k_p;
+                c_gains = &c_mem.k_p;
+                break;
 
-    int32 CYDATA k_p_c_dl = c_mem.k_p_c_dl;  
-    int32 CYDATA k_i_c_dl = c_mem.k_i_c_dl; 
-    int32 CYDATA k_d_c_dl = c_mem.k_d_c_dl;  
+            case TUNE_LOOP_CASC:
+                g_gains = &g_mem.k_p_dl;
+                c_gains = &c_mem.k_p_dl;
+                break;
 
-    // Static Variables
-    
-    static CYBIT dirM0, dirM1;
-    
-    static int32 pos_error_sum[NUM_OF_MOTORS];
-    static int32 curr_error_sum[NUM_OF_MOTORS];
-    static int32 prev_curr_err[NUM_OF_MOTORS];
+            default:
+                if (c_mem.control_mode == CONTROL_CURRENT) {
+                    g_gains = &g_mem.k_p_c;
+                    c_gains = &c_mem.k_p_c;
+                }
+                else {
+                    g_gains = &g_mem.k_p_c_dl;
+                    c_gains = &c_mem.k_p_c_dl;
+                }
+                break;
+        }
 
-    // check index value
-    if (index >= NUM_OF_MOTORS)
-        return;
-    // --------------- USE THIRD ENCODER AS INPUT FOR BOTH MOTORS --------------
-    if (c_mem.input_mode == INPUT_MODE_ENCODER3) {
+        // P, I and D, at 1 kHz as stored
+        g_gains[0] = (ku / 3) * 65536;
+        g_gains[1] = (ku / 3) * 2 / tu * 65536;
+        g_gains[2] = (ku / 3) * tu / 3 * 65536;
+
+        if (tune_apply)
+            for (i = 3; i--;)
+                c_gains[i] = g_gains[i];
+
+        // Cascade, tune the outer loop on the new current loop
+        if ((tune_loop == TUNE_LOOP_CURR) && (c_mem.control_mode != CONTROL_CURRENT)) {
+            gains.k_p_c = g_mem.k_p_c_dl;
+            gains.k_i_c = RATE_SCALE(g_mem.k_i_c_dl, -rate_shift);
+            gains.k_d_c = RATE_SCALE(g_mem.k_d_c_dl, rate_shift);
+            curr_sat_setup();
+            gains_lim_setup();
+            for (i = NUM_OF_MOTORS; i--;)
+                curr_error_sum[i] = 0;
+
+            tune_loop_start(TUNE_LOOP_CASC);
+            return;
+        }
 
-        g_ref.pos[index] = g_measOld.pos[2];
+        tune_status = TUNE_DONE;
+    }
+    else
+        tune_status = TUNE_FAILED;
 
-        // position limit
-        if (c_mem.pos_lim_flag) {
-            if (g_ref.pos[index] < c_mem.pos_lim_inf[index]) 
-                g_ref.pos[index] = c_mem.pos_lim_inf[index];
-            if (g_ref.pos[index] > c_mem.pos_lim_sup[index]) 
-                g_ref.pos[index] = c_mem.pos_lim_sup[index];
-        }
+    tune_loop = 0;
+
+    for (i = NUM_OF_MOTORS; i--;) {
+        pos_error_sum[i] = 0;
+        curr_error_sum[i] = 0;
     }
 
-    switch(c_mem.control_mode) {
-        case CONTROL_ANGLE:
-        case DEFLECTION_CONTROL:
-        
-            if(c_mem.control_mode == DEFLECTION_CONTROL){
-				//for deflection control the shaft position must be summed to reference
-                defl_input[index] = (g_ref.pos[index] + g_meas.pos[2]);
-                pos_error = defl_input[index] - g_meas.pos[index];
-            }
-            else 
-                // position error
-                pos_error = g_ref.pos[index] - g_meas.pos[index];
-           
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
-            
-            // error sum for integral
-            pos_error_sum[index] += pos_error;
+    control_setup();
+}
 
-            //anti wind-up
-            if (pos_error_sum[index] > POS_INTEGRAL_SAT_LIMIT)
-                pos_error_sum[index] = POS_INTEGRAL_SAT_LIMIT;
-            else{
-                if (pos_error_sum[index] < -POS_INTEGRAL_SAT_LIMIT)
-                    pos_error_sum[index] = -POS_INTEGRAL_SAT_LIMIT;
-            }
-              
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
-            // pwm_input init
-            pwm_input = 0;
-            // Proportional
-            if (k_p != 0) {
-                    
-                if ((pos_error > 131072) || (pos_error < -131072))  //if grater than 2^17
-                    pwm_input = (int32)(k_p * (pos_error >> 8)) >> 8;
-                else
-                    pwm_input = (int32)(k_p * pos_error) >> 16;
-            }
-            
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
-                      
-            // Integral
-            if (k_i != 0) 
-                pwm_input += (int32)((k_i >> 6) * pos_error_sum[index]) >> 10;
-            
-            // Derivative
-            if (k_d != 0)
-                pwm_input += (int32)(k_d * (g_measOld.pos[index] - g_meas.pos[index])) >> 16;
-         
-    
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
-             
-            // Update measure
-            //prev_pos[index] = g_meas.pos[index];
-
-            if (index == 0){
-                if (pwm_input >= 0)
-                    dirM0 = 1;
-                    //direction |= 0x01;
-                else
-                    dirM0 = 0;
-                    //direction &= 0xFE;
-            }else{ // index == 1
-                if (pwm_input >= 0)
-                    dirM1 = 1;
-                   // direction |= 0x02;
-                else
-                    dirM1 = 0;
-                    //direction &= 0xFD;
-            }
-            
-            break;
+//------------------------------------------------------------------     relay
 
-        case CURR_AND_POS_CONTROL:
-        case DEFL_CURRENT_CONTROL:
+static void ctrl_autotune(void) {
 
-            if(c_mem.control_mode == DEFL_CURRENT_CONTROL){
-                //for deflection control the shaft position must be summed to reference
-                defl_input[index] = (g_ref.pos[index] + g_meas.pos[2]);
-                pos_error = defl_input[index] - g_meas.pos[index];
-            }
-            else 
-                pos_error = g_ref.pos[index] - g_meas.pos[index];
+    uint8 CYDATA i;
+    int32 CYDATA error;
 
-            pos_error_sum[index] += pos_error;
+    // Position relay runs at the position loop frequency
+    if ((tune_loop == TUNE_LOOP_POS) && !pos_loop_tick)
+        return;
 
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
 
-            // error_sum saturation
-            if (pos_error_sum[index] > POS_INTEGRAL_SAT_LIMIT)
-                pos_error_sum[index] = POS_INTEGRAL_SAT_LIMIT;
-            else{
-                if (pos_error_sum[index] < -POS_INTEGRAL_SAT_LIMIT)
-                    pos_error_sum[index] = -POS_INTEGRAL_SAT_LIMIT;
-            }
-            // ------ position PID control -----
+        if (tune_loop == TUNE_LOOP_CURR)
+            error = -g_meas.curr_loop[i];
+        else {
+            error = g_ref.pos[i] - g_meas.pos[i];
+            if (ctrl_deflection)
+                error += g_meas.pos[2];
+        }
 
-            curr_ref = 0;
+        pwm_out[i] = tune_relay(i, error);
+    }
 
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+    ctrl_output();
+}
 
-            // Proportional
-            if (k_p_dl != 0) {
-                if ((pos_error > 131072) || (pos_error < -131072))
-                    curr_ref += (int32)(k_p_dl * (pos_error >> 8)) >> 8;
-                else
-                    curr_ref += (int32)(k_p_dl * pos_error) >> 16;
-            }
+//==============================================================================
+//                                                   FREQUENCY RESPONSE ANALYSIS
+//==============================================================================
+// Stepped sine sweep on g_fra.points frequencies, log spaced. The excitation
+// is added to the position references of both motors, or to the PWM of both
+// motors after the control loops, which keep running. At each point, after
+// FRA_SETTLE periods, excitation u of the motor under test and output y are
+// correlated with the excitation sine and cosine over an integer number of
+// periods, with the means removed. Their ratio gives gain and phase. Sums are
+// kept in 32 bits for FRA_FLUSH samples, then added in float, so that long
+// low frequency points do not overflow them.
+//==============================================================================
 
-            // Integral
-            if (k_i_dl != 0)
-                curr_ref += (int32)(k_i_dl * pos_error_sum[index]) >> 16;
-            
-            // Derivative
-            if (k_d_dl != 0)
-                curr_ref += (int32)(k_d_dl * (g_measOld.pos[index] - g_meas.pos[index])) >> 16;
-                        
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+// Sine quarter wave, Q15, 64 steps
+CYCODE int16 fra_sin_table[65] = {
+        0,   804,  1608,  2410,  3212,  4011,  4808,  5602,
+     6393,  7179,  7962,  8739,  9512, 10278, 11039, 11793,
+    12539, 13279, 14010, 14732, 15446, 16151, 16846, 17530,
+    18204, 18868, 19519, 20159, 20787, 21403, 22005, 22594,
+    23170, 23731, 24279, 24811, 25329, 25832, 26319, 26790,
+    27245, 27683, 28105, 28510, 28898, 29268, 29621, 29956,
+    30273, 30571, 30852, 31113, 31356, 31580, 31785, 31971,
+    32137, 32285, 32412, 32521, 32609, 32678, 32728, 32757,
+    32767 };
+
+// Sine on 256 steps for a turn
+
+static int16 fra_sin(const uint8 idx) {
+
+    switch(idx >> 6) {
+        case 0:
+            return fra_sin_table[idx & 0x3F];
+        case 1:
+            return fra_sin_table[64 - (idx & 0x3F)];
+        case 2:
+            return -fra_sin_table[idx & 0x3F];
+        default:
+            return -fra_sin_table[64 - (idx & 0x3F)];
+    }
+}
 
-            // saturate max current
-            if (curr_ref > c_mem.current_limit)
-                curr_ref = c_mem.current_limit;
-            else {
-                if (curr_ref < -c_mem.current_limit)
-                    curr_ref = -c_mem.current_limit;
-            }
+uint8 fra_start(const uint8 input, const uint8 output, const uint8 points,
+                const uint16 f_start, const uint16 f_stop, const int32 amp) {
+
+    uint8 CYDATA i;
+    uint16 CYDATA f_max;
+
+    // Motors must be active, not calibrating, tuning nor identifying friction
+    if (((g_ref.onoff & 0x03) != 0x03) || (calibration_flag != STOP) || tune_loop ||
+        (control_kernel == KERNEL_FRIC_IDENT) || (g_fra.status == FRA_RUNNING))
+        return FALSE;
+
+    // Frequencies in 0.1 Hz, up to a quarter of the Nyquist frequency of the
+    // loop excited, the position one in position modes
+    f_max = (uint16)1250 << rate_shift;
+    if ((c_mem.control_mode != CONTROL_CURRENT) && (c_mem.control_mode != CONTROL_PWM))
+        f_max /= c_mem.pos_div;
+
+    if (!points || (points > FRA_MAX_POINTS) || !f_start || (f_stop < f_start) ||
+        (f_stop > f_max) || (amp <= 0) || (output >= NUM_OF_SENSORS + NUM_OF_MOTORS))
+        return FALSE;
+
+    for (i = NUM_OF_MOTORS; i--;) {
+        switch(input) {
+            case FRA_INPUT_REF:
+                if (c_mem.control_mode == CONTROL_PWM)
+                    return FALSE;
+                fra_amp[i] = amp << c_mem.res[i];
+                break;
 
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+            case FRA_INPUT_PWM:
+                if (amp > PWM_MAX_VALUE)
+                    return FALSE;
+                fra_amp[i] = amp << PWM_OUT_SHIFT;
+                break;
 
-            // current error and error sum
-            curr_error = curr_ref - g_meas.curr[index];
-            curr_error_sum[index] += curr_error;
+            default:
+                return FALSE;
+        }
+    }
 
-            if (curr_error_sum[index] > CURR_INTEGRAL_SAT_LIMIT)
-                curr_error_sum[index] = CURR_INTEGRAL_SAT_LIMIT;
-            else{
-                if (curr_error_sum[index] < -CURR_INTEGRAL_SAT_LIMIT)
-                    curr_error_sum[index] = -CURR_INTEGRAL_SAT_LIMIT;
-            }
+    fra_input = input;
+    fra_output = output;
 
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+    // Motor of the output, the first one for the other sensors
+    fra_motor = 0;
+    if (output < NUM_OF_MOTORS)
+        fra_motor = output;
+    if (output >= NUM_OF_SENSORS)
+        fra_motor = output - NUM_OF_SENSORS;
 
-            // ----- current PID control -----
+    g_fra.points = points;
+    g_fra.done = 0;
+    g_fra.freq[0] = f_start * 0.1;
+    fra_ratio = (points > 1) ? pow((float)f_stop / f_start, 1.0 / (points - 1)) : 1.0;
 
-            pwm_input = 0;
+    fra_phase = 0;
+    fra_point_start();
+    g_fra.status = FRA_RUNNING;
 
-            // Proportional
-            if (k_p_c_dl != 0)
-                pwm_input += (int32)(k_p_c_dl * curr_error) >> 16;
-            
-            // Integral
-            if (k_i_c_dl != 0)
-                pwm_input += (int32)(k_i_c_dl * curr_error_sum[index]) >> 16;
-            
-            // Derivative
-            if (k_d_c_dl != 0)
-                pwm_input += (int32)(k_d_c_dl * (g_measOld.curr[index] - g_meas.curr[index])) >> 16;
+    return TRUE;
+}
 
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+static void fra_point_start(void) {
 
-            if (index == 0){
-                if (pwm_input >= 0)
-                    dirM0 = 1;
-                    //direction |= 0x01;
-                else
-                    dirM0 = 0;
-                    //direction &= 0xFE;
-            }else{ // index == 1
-                if (pwm_input >= 0)
-                    dirM1 = 1;
-                   // direction |= 0x02;
-                else
-                    dirM1 = 0;
-                    //direction &= 0xFD;
-            }
+    uint8 CYDATA i;
+    float periods;
 
-            break;
+    fra_phase_step = g_fra.freq[g_fra.done] * (4294967.296 / (1 << rate_shift));
 
-        case CONTROL_CURRENT:
+    periods = g_fra.freq[g_fra.done] * (FRA_MIN_TIME / 1000.0);
+    if (periods < FRA_PERIODS)
+        periods = FRA_PERIODS;
+    if (periods > FRA_MAX_PERIODS)
+        periods = FRA_MAX_PERIODS;
 
-            // Current ref from pos ref
-            curr_ref = g_ref.pos[index] >> g_mem.res[index];
+    fra_turns = 0;
+    fra_turns_end = FRA_SETTLE + (uint8)(periods + 0.5);
 
-            // saturate max current
-            if (curr_ref > c_mem.current_limit)
-                curr_ref = c_mem.current_limit;
-            else {
-                if(curr_ref < -c_mem.current_limit)
-                   curr_ref = -c_mem.current_limit;
-            }
-            // Current error
-            curr_error = curr_ref - g_meas.curr[index];
+    fra_n = 0;
+    for (i = FRA_SUMS; i--;) {
+        fra_acc[i] = 0;
+        fra_sum[i] = 0;
+    }
+}
 
-            // Error sum for integral
-            curr_error_sum[index] += curr_error;
+static void fra_flush(void) {
 
-            //anti wind-up
-            if (curr_error_sum[index] > CURR_INTEGRAL_SAT_LIMIT)
-                curr_error_sum[index] = CURR_INTEGRAL_SAT_LIMIT;
-            else {
-                if (curr_error_sum[index] < -CURR_INTEGRAL_SAT_LIMIT)
-                    curr_error_sum[index] = -CURR_INTEGRAL_SAT_LIMIT;
-            }
+    uint8 CYDATA i;
 
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+    for (i = FRA_SUMS; i--;) {
+        fra_sum[i] += fra_acc[i];
+        fra_acc[i] = 0;
+    }
+}
 
-            // pwm_input init
-            pwm_input = 0;
+// Once per main cycle, before the control kernel
 
-            // Proportional
-            if (k_p_c != 0)
-                pwm_input += (int32)(k_p_c * curr_error) >> 16;
+static void fra_update(void) {
 
-            // Integral
-            if (k_i_c != 0)
-                pwm_input += (int32)(k_i_c * (curr_error_sum[index] >> 6)) >> 10;
-            
-            // Derivative
-            if (k_d_c != 0)
-                pwm_input += (int32)(k_d_c * (curr_error - prev_curr_err[index])) >> 16;
+    uint8 CYDATA i;
+    uint32 CYDATA phase;
+    int32 CYDATA s;
+    int32 CYDATA c;
+    int32 CYDATA y;
+    float u_s, u_c, y_s, y_c, den;
 
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
-            }
+    // Motors deactivated
+    if ((g_ref.onoff & 0x03) != 0x03) {
+        fra_stop(FRA_FAILED);
+        return;
+    }
 
-            // Update measure
-            prev_curr_err[index] = curr_error;
-            
-            if (index == 0){
-                if (pwm_input >= 0)
-                    dirM0 = 1;
-                    //direction |= 0x01;
-                else
-                    dirM0 = 0;
-                    //direction &= 0xFE;
-            }else{ // index == 1
-                if (pwm_input >= 0)
-                    dirM1 = 1;
-                   // direction |= 0x02;
-                else
-                    dirM1 = 0;
-                    //direction &= 0xFD;
+    phase = fra_phase;
+    fra_phase += fra_phase_step;
+
+    // A period ends on each phase wrap
+    if (fra_phase < phase) {
+        fra_turns++;
+
+        if (fra_turns == fra_turns_end) {
+
+            // Correlations without means, output over input
+            fra_flush();
+            u_s = fra_sum[FRA_US] - (fra_sum[FRA_U] * fra_sum[FRA_S]) / fra_n;
+            u_c = fra_sum[FRA_UC] - (fra_sum[FRA_U] * fra_sum[FRA_C]) / fra_n;
+            y_s = fra_sum[FRA_YS] - (fra_sum[FRA_Y] * fra_sum[FRA_S]) / fra_n;
+            y_c = fra_sum[FRA_YC] - (fra_sum[FRA_Y] * fra_sum[FRA_C]) / fra_n;
+
+            den = u_s * u_s + u_c * u_c;
+            i = g_fra.done;
+            if (den > 0) {
+                g_fra.gain[i] = sqrt((y_s * y_s + y_c * y_c) / den);
+                g_fra.phase[i] = (atan2(y_c, y_s) - atan2(u_c, u_s)) * (180.0 / 3.14159);
+                if (g_fra.phase[i] > 180.0)
+                    g_fra.phase[i] -= 360.0;
+                if (g_fra.phase[i] <= -180.0)
+                    g_fra.phase[i] += 360.0;
             }
-
-            if (interrupt_flag){
-                interrupt_flag = FALSE;
-                interrupt_manager();
+            else {
+                g_fra.gain[i] = 0;
+                g_fra.phase[i] = 0;
             }
-            
-            break;
 
-        case CONTROL_PWM:
-            // Direct PWM value
-            pwm_input = g_ref.pos[index] >> g_mem.res[index];
-
-            if (index == 0){
-                if (pwm_input >= 0)
-                    dirM0 = 1;
-                    //direction |= 0x01;
-                else
-                    dirM0 = 0;
-                    //direction &= 0xFE;
-            }else{ // index == 1
-                if (pwm_input >= 0)
-                    dirM1 = 1;
-                   // direction |= 0x02;
-                else
-                    dirM1 = 0;
-                    //direction &= 0xFD;
+            if (++g_fra.done == g_fra.points) {
+                fra_stop(FRA_DONE);
+                return;
             }
 
-            break;
-
-        default:
-            break;
-    }
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+            g_fra.freq[g_fra.done] = g_fra.freq[i] * fra_ratio;
+            fra_point_start();
+            fra_phase = 0;
+        }
     }
-        
-    // abs(pwm_input) must be lower or equal to PWM_MAX_VALUE
-    if(pwm_input >  PWM_MAX_VALUE) 
-        pwm_input =  PWM_MAX_VALUE;
-    if(pwm_input < -PWM_MAX_VALUE) 
-        pwm_input = -PWM_MAX_VALUE;
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
-    }   
 
-    // remap pwm_input on pwm_limit based on input tension to have maximum 8 volts
-    if (c_mem.control_mode != CONTROL_PWM)
-        pwm_input = (((pwm_input << 10) / PWM_MAX_VALUE) * dev_pwm_limit) >> 10;
+    s = fra_sin(fra_phase >> 24);
+    c = fra_sin((fra_phase >> 24) + 64);
 
-    // drive direction and pwm duty cycle
-        
-    if (dirM0){
-        if (dirM1)
-            MOTOR_DIR_Write(0x03);
+    for (i = NUM_OF_MOTORS; i--;) {
+        if (fra_input == FRA_INPUT_REF)
+            fra_ref[i] = fxp_mul(fra_amp[i], s, 15);
         else
-            MOTOR_DIR_Write(0x01);
-    }
-    else{
-        if (dirM1)
-            MOTOR_DIR_Write(0x02);
-        else
-            MOTOR_DIR_Write(0x00);
+            fra_pwm[i] = fxp_mul(fra_amp[i], s, 15);
     }
+    fra_u = (fra_input == FRA_INPUT_REF) ? fra_ref[fra_motor] : fra_pwm[fra_motor];
 
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
-    }
-    
-    if (index == 0) {
-        pwm_sign[0] = SIGN(pwm_input);
-        PWM_MOTORS_WriteCompare1(abs(pwm_input));
-    }
-    else { // index == 1
-        pwm_sign[1] = SIGN(pwm_input);
-        PWM_MOTORS_WriteCompare2(abs(pwm_input));
-    }
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
+    if (fra_turns < FRA_SETTLE)
+        return;
+
+    if (fra_output < NUM_OF_SENSORS)
+        y = g_meas.pos[fra_output];
+    else
+        y = g_meas.curr[fra_output - NUM_OF_SENSORS];
+
+    // Output from its value at the start of the measure
+    if (!fra_n)
+        fra_y0 = y;
+    y -= fra_y0;
+
+    fra_n++;
+    fra_acc[FRA_U] = fxp_add(fra_acc[FRA_U], fra_u);
+    fra_acc[FRA_Y] = fxp_add(fra_acc[FRA_Y], y);
+    fra_acc[FRA_S] = fxp_add(fra_acc[FRA_S], s);
+    fra_acc[FRA_C] = fxp_add(fra_acc[FRA_C], c);
+    fra_acc[FRA_US] = FXP_MAC(fra_acc[FRA_US], fra_u, s, 15);
+    fra_acc[FRA_UC] = FXP_MAC(fra_acc[FRA_UC], fra_u, c, 15);
+    fra_acc[FRA_YS] = FXP_MAC(fra_acc[FRA_YS], y, s, 15);
+    fra_acc[FRA_YC] = FXP_MAC(fra_acc[FRA_YC], y, c, 15);
+
+    if (!(fra_n & (FRA_FLUSH - 1)))
+        fra_flush();
+}
+
+static void fra_stop(const uint8 status) {
+
+    uint8 CYDATA i;
+
+    fra_u = 0;
+    for (i = NUM_OF_MOTORS; i--;) {
+        fra_ref[i] = 0;
+        fra_pwm[i] = 0;
     }
+    g_fra.status = status;
 }
 
 //==============================================================================
@@ -800,6 +1995,10 @@ void motor_control(const uint8 idx) {
 //==============================================================================
 
 void analog_read_end() {
+
+    int32 CYDATA curr;
+    int32 CYDATA adc[ADC_CHANNELS];
+    uint8 CYDATA k;
        
     /* =========================================================================
     /   Ideal formulation to calculate tension and current
@@ -816,24 +2015,35 @@ void analog_read_end() {
     /   Real formulation: tradeoff in good performance and accurancy, ADC_buf[] 
     /   and offset unit of measurment is counts, instead dev_tension and
     /   g_meas.curr[] are converted in properly unit.
+    /
+    /   Samples are the average of the ones converted during last cycle, so
+    /   they are always one cycle old.
     /  =========================================================================
     */
     
-    // Wait for conversion end
-    while(!ADC_STATUS_Read()){
-        if (interrupt_flag){
-            interrupt_flag = FALSE;
-            interrupt_manager();
-        }
+    // No conversion completed, hold last measurements
+    if (!adc_ready) {
+        g_meas.curr[0] = g_measOld.curr[0];
+        g_meas.curr[1] = g_measOld.curr[1];
+        g_meas.curr_loop[0] = g_measOld.curr_loop[0];
+        g_meas.curr_loop[1] = g_measOld.curr_loop[1];
+        return;
+    }
+    adc_ready = FALSE;
+
+    // Average conversions
+    adc[0] = adc[1] = adc[2] = 0;
+    for (k = ADC_OVERSAMPLING; k--;) {
+        adc[0] += ADC_buf[adc_idx][k][0];
+        adc[1] += ADC_buf[adc_idx][k][1];
+        adc[2] += ADC_buf[adc_idx][k][2];
     }
+    adc[0] >>= ADC_OVERSAMPLING_SHIFT;
+    adc[1] >>= ADC_OVERSAMPLING_SHIFT;
+    adc[2] >>= ADC_OVERSAMPLING_SHIFT;
     
     // Convert tension read
-    dev_tension = ((int32)(ADC_buf[0] - 1638) * 1952) >> 7;
-    
-    if (interrupt_flag){
-        interrupt_flag = FALSE;
-        interrupt_manager();
-    }
+    dev_tension = ((adc[0] - ADC_ZERO) * 1952) >> 7;
 
     // Until there is no valid input tension repeat this measurement
     
@@ -841,36 +2051,79 @@ void analog_read_end() {
         
         // Set PWM depends on tension
         pwm_limit_search();
-        
-        // Check Interrupt 
-    
-        if (interrupt_flag){
-            interrupt_flag = FALSE;
-            interrupt_manager();
-        }
+
+        curr_offset_calibration(adc[1], adc[2]);
 
         // Filter and Set currents
-        g_meas.curr[0] = filter_i1((int16) pwm_sign[0] * (((int32)(ADC_buf[1] - 1638) * 25771) >> 13));
-        
-        // Check Interrupt 
-    
-        if (interrupt_flag){
-            interrupt_flag = FALSE;
-            interrupt_manager();
-        }
-        g_meas.curr[1] = filter_i2((int16) pwm_sign[1] * (((int32)(ADC_buf[2] - 1638) * 25771) >> 13));
-        
-        // Check Interrupt 
-    
-        if (interrupt_flag){
-            interrupt_flag = FALSE;
-            interrupt_manager();
-        }
+        curr = (int16) adc_sign[adc_idx][0] * (((adc[1] - curr_zero[0]) * 25771) >> 13);
+        g_meas.curr[0] = filter(FILTER_CURR_1, curr);
+        g_meas.curr_loop[0] = filter(FILTER_CURR_LOOP_1, curr);
+
+        curr = (int16) adc_sign[adc_idx][1] * (((adc[2] - curr_zero[1]) * 25771) >> 13);
+        g_meas.curr[1] = filter(FILTER_CURR_2, curr);
+        g_meas.curr_loop[1] = filter(FILTER_CURR_LOOP_2, curr);
     }
     else {
         g_meas.curr[0] = 0;
         g_meas.curr[1] = 0;
+        g_meas.curr_loop[0] = 0;
+        g_meas.curr_loop[1] = 0;
+    }
+}
+
+//==============================================================================
+//                                                   CURRENT OFFSETS CALIBRATION
+//==============================================================================
+// Measure current sensors offsets while motors are off: wait for currents to
+// decay, average 2^CURR_OFFSET_SAMPLES_SHIFT cycles, then keep trimming slowly
+// until motors are activated again. At startup motors are activated only
+// after the first measure, unless the host activates or deactivates them
+// explicitly before (see activ_pending).
+//==============================================================================
+
+static void curr_offset_calibration(const int32 adc_1, const int32 adc_2) {
+
+    uint16 CYDATA settle = (uint16)CURR_OFFSET_SETTLE << rate_shift;
+
+    static uint16 cnt;                      // cycles since motors deactivation
+    static int32 sum[NUM_OF_MOTORS];
+
+    // Motors driven, measure again at next deactivation
+    if (MOTOR_ON_OFF_Read() & 0x03) {
+        cnt = 0;
+        return;
+    }
+
+    if (cnt < settle) {
+        cnt++;
+        sum[0] = 0;
+        sum[1] = 0;
+        return;
+    }
+
+    if (cnt < settle + (1 << CURR_OFFSET_SAMPLES_SHIFT)) {
+        cnt++;
+        sum[0] += adc_1;
+        sum[1] += adc_2;
+
+        if (cnt < settle + (1 << CURR_OFFSET_SAMPLES_SHIFT))
+            return;
+
+        curr_offset[0] = sum[0] << (12 - CURR_OFFSET_SAMPLES_SHIFT);
+        curr_offset[1] = sum[1] << (12 - CURR_OFFSET_SAMPLES_SHIFT);
+
+        if (activ_pending) {
+            activ_pending = FALSE;
+            MOTOR_ON_OFF_Write(g_ref.onoff);
+        }
+    }
+    else {
+        curr_offset[0] += ((adc_1 << 12) - curr_offset[0]) >> CURR_OFFSET_TRIM_SHIFT;
+        curr_offset[1] += ((adc_2 << 12) - curr_offset[1]) >> CURR_OFFSET_TRIM_SHIFT;
     }
+
+    curr_zero[0] = curr_offset[0] >> 12;
+    curr_zero[1] = curr_offset[1] >> 12;
 }
 
 //==============================================================================
@@ -893,9 +2146,12 @@ void encoder_reading(const uint8 idx)
     
     static CYBIT only_first_time = TRUE;
 
-    // static int32 l_value[NUM_OF_SENSORS];   //last value for vel
-    // static int32 ll_value[NUM_OF_SENSORS];  //last last value for vel
-    // static int32 lll_value[NUM_OF_SENSORS];  //last last last value for vel
+    static uint8 vel_restart = 0xFF;        // velocity estimators to restart, bitmask
+
+    // Sensor state, published in g_meas every cycle since it is double buffered
+    static int32 enc_pos[NUM_OF_SENSORS];
+    static int8 enc_rot[NUM_OF_SENSORS];
+    static int16 enc_vel[NUM_OF_SENSORS];
 
     if (index >= NUM_OF_SENSORS)
         return;
@@ -903,10 +2159,17 @@ void encoder_reading(const uint8 idx)
     if (reset_last_value_flag) {
         for (jj = NUM_OF_SENSORS; jj--;) {
             last_value_encoder[jj] = 0;
+            enc_rot[jj] = 0;
         }
         reset_last_value_flag = 0;
+        vel_restart = 0xFF;
     }
 
+    // Last valid values, if this reading is discarded
+    g_meas.pos[index] = enc_pos[index];
+    g_meas.rot[index] = enc_rot[index];
+    g_meas.vel[index] = enc_vel[index];
+
     //======================================================     reading sensors
     if (index == 0)
             data_encoder = SHIFTREG_ENC_1_ReadData() & 0x3FFFF;
@@ -955,10 +2218,10 @@ void encoder_reading(const uint8 idx)
         // equal to 250 turn/s -> 15000 RPM
 
         if (aux > 49152)
-            g_meas.rot[index]--;
+            enc_rot[index]--;
         else{ 
             if (aux < -49152)
-                g_meas.rot[index]++;
+                enc_rot[index]++;
             else{
                 if (abs(aux) > 16384) { // if two measure are too far
                     error[index]++;
@@ -973,34 +2236,72 @@ void encoder_reading(const uint8 idx)
         
         last_value_encoder[index] = value_encoder;
 
-        value_encoder += (int32)g_meas.rot[index] << 16;
+        value_encoder += (int32)enc_rot[index] << 16;
 
-        if (c_mem.m_mult[index] != 1.0)
-            value_encoder *= c_mem.m_mult[index];
+        if (m_mult_active & (0x01 << index))
+            value_encoder = fxp_mul(value_encoder, m_mult_mul[index], m_mult_shift[index]);
+
+        // velocity from multi-turn position, not after a position reset
+        if (vel_restart & (0x01 << index)) {
+            vel_restart &= ~(0x01 << index);
+            velocity_estimation(index, 0);
+            enc_vel[index] = 0;
+        }
+        else
+            enc_vel[index] = velocity_estimation(index, value_encoder - enc_pos[index]);
       
-        g_meas.pos[index] = value_encoder;
+        enc_pos[index] = value_encoder;
+
+        g_meas.pos[index] = enc_pos[index];
+        g_meas.rot[index] = enc_rot[index];
+        g_meas.vel[index] = enc_vel[index];
+    }
+}
+
+//==============================================================================
+//                                                           VELOCITY ESTIMATION
+//==============================================================================
+// Return velocity in ticks/ms from the position increment of last cycle,
+// with the estimator selected in c_mem.vel_estimator:
+// - VEL_EST_DIFFERENCE: position difference through the velocity filters;
+// - VEL_EST_OBSERVER: second order tracking loop, about 50 Hz bandwidth,
+//   which follows the position with a model integrating its own velocity.
+// Gains are given at 1 kHz and scaled with the main frequency.
+//==============================================================================
+
+static int16 velocity_estimation(const uint8 index, const int32 pos_step) {
+
+    int32 CYDATA vel;
+
+    static int32 obs_err[NUM_OF_SENSORS];   // position tracking error, Q8
+    static int32 obs_vel[NUM_OF_SENSORS];   // velocity, Q8 ticks per cycle
+
+    if (c_mem.vel_estimator == VEL_EST_OBSERVER) {
+
+        obs_err[index] += pos_step << 8;
+
+        // velocity integrates the tracking error
+        obs_vel[index] += (obs_err[index] * 3) >> (5 + (rate_shift << 1));
+
+        // estimated position follows velocity plus a correction on error
+        obs_err[index] -= obs_vel[index] + ((obs_err[index] * 5) >> (3 + rate_shift));
+
+        vel = (obs_vel[index] << rate_shift) >> 8;
+    }
+    else {
+        vel = filter(FILTER_VEL_1 + index, pos_step << rate_shift);
+
+        obs_err[index] = 0;
+        obs_vel[index] = vel << (8 - rate_shift);
     }
 
-    // // velocity calculation
-    // switch(i) {
-    //     case 0: {
-    //         g_meas.vel[i] = (int16)filter_vel_1((3*value_encoder + l_value[i] - ll_value[i] - 3*lll_value[i]) / 10);
-    //         break;
-    //     }
-    //     case 1: {
-    //         g_meas.vel[i] = (int16)filter_vel_2((3*value_encoder + l_value[i] - ll_value[i] - 3*lll_value[i]) / 10);
-    //         break;
-    //     }
-    //     case 2: {
-    //         g_meas.vel[i] = (int16)filter_vel_3((3*value_encoder + l_value[i] - ll_value[i] - 3*lll_value[i]) / 10);
-    //         break;
-    //     }
-    // }
-
-    // // update old values
-    // lll_value[i] = ll_value[i];
-    // ll_value[i] = l_value[i];
-    // l_value[i] = value_encoder;
+    // saturate on int16
+    if (vel > 32767)
+        vel = 32767;
+    if (vel < -32768)
+        vel = -32768;
+
+    return (int16)vel;
 }
 
 
@@ -1014,12 +2315,14 @@ void calibration()
     static int32 old_k_i;
     static int32 old_k_d;
 
-    static uint8 pause_counter = 0;
+    static uint16 pause_counter = 0;
+
+    uint8 CYDATA i;
+    int32 CYDATA ramp;
+    int32 CYDATA curr;
 
     switch(calibration_flag) {
         case START:
-            ISR_RS485_RX_Disable();
-
             // save old PID values
             old_k_p = c_mem.k_p;
             old_k_i = c_mem.k_i;
@@ -1035,38 +2338,75 @@ void calibration()
             }
 
             // wait for motors to reach zero position
+            g_calib.pre = 0;
+            g_calib.steps = 0;
+            calib_step = CALIB_STEP;
+            g_calib.failed = FALSE;
+            pause_counter = 0;
             calibration_flag = PAUSE_1;
             break;
 
         case PAUSE_1:
             pause_counter++;
 
-            if (pause_counter == 10) {
+            if (pause_counter >= ((uint16)CALIB_PAUSE << rate_shift)) {
                 pause_counter = 0;
 
                 // set new temp values for PID parameters
                 c_mem.k_p = 0.1 * 65536;
                 c_mem.k_i = 0;
                 c_mem.k_d = 0.3 * 65536;
+                control_setup();
 
                 calibration_flag = CONTINUE_1;
             }
             break;
 
         case CONTINUE_1:
-            // increment of 0.5 degree
-            g_refNew.pos[0] += 65536 / 720;
-            g_refNew.pos[1] -= 65536 / 720;
+            // record spring torque, as the mean motors current, on pretension.
+            // Currents of the current loops: g_meas.curr lags the ramp
+            if ((g_calib.pre >> 8) >= (int32)g_calib.steps * calib_step) {
+
+                // buffer full, keep every other step and double the step,
+                // so that the whole pretension range fits
+                if (g_calib.steps == SPRING_CALIB_STEPS) {
+                    for (i = 1; i < (SPRING_CALIB_STEPS >> 1); i++) {
+                        calib_pre[i] = calib_pre[i << 1];
+                        calib_torque[i] = calib_torque[i << 1];
+                    }
+                    g_calib.steps = SPRING_CALIB_STEPS >> 1;
+                    calib_step <<= 1;
+                }
+
+                calib_pre[g_calib.steps] = (g_meas.pos[0] - g_meas.pos[1]) >> 1;
+                calib_torque[g_calib.steps] = (labs(g_meas.curr_loop[0]) + labs(g_meas.curr_loop[1])) >> 1;
+                g_calib.steps++;
+            }
+
+            // pretension ramp, from CALIB_RAMP_FAST at no current down to
+            // CALIB_RAMP_SLOW at CALIB_CURRENT
+            curr = (g_meas.curr_loop[0] > g_meas.curr_loop[1]) ? g_meas.curr_loop[0] : g_meas.curr_loop[1];
+            ramp = CALIB_RAMP_SLOW;
+            if (curr < 0)
+                curr = 0;
+            if (curr < CALIB_CURRENT)
+                ramp += ((int32)(CALIB_RAMP_FAST - CALIB_RAMP_SLOW) * (CALIB_CURRENT - curr)) / CALIB_CURRENT;
+
+            g_calib.pre += ramp >> rate_shift;
+            g_refNew.pos[0] = g_calib.pre >> 8;
+            g_refNew.pos[1] = -(g_calib.pre >> 8);
 
             // check if one of the motors reach the threashold
-            if ((g_meas.curr[0] > CALIB_CURRENT) || (g_meas.curr[1] > CALIB_CURRENT)) {
+            if ((g_meas.curr_loop[0] > CALIB_CURRENT) || (g_meas.curr_loop[1] > CALIB_CURRENT)) {
                 // save current value as MAX_STIFFNESS
                 g_mem.max_stiffness = g_ref.pos[0];
+                spring_map_build();
 
                 // reset old values for PID parameters
                 c_mem.k_p = old_k_p;
                 c_mem.k_i = old_k_i;
                 c_mem.k_d = old_k_d;
+                control_setup();
 
                 // go back to zero position
                 g_refNew.pos[0] = 0;
@@ -1080,8 +2420,8 @@ void calibration()
         case PAUSE_2:
             pause_counter++;
 
-            if (pause_counter == 10) {
-                pause_counter =0;
+            if (pause_counter >= ((uint16)CALIB_PAUSE << rate_shift)) {
+                pause_counter = 0;
 
                 calibration_flag = CONTINUE_2;
             }
@@ -1093,13 +2433,42 @@ void calibration()
                 MOTOR_ON_OFF_Write(0x00);
             }
 
-            // store memory to save MAX_STIFFNESS as default value
-            memStore(DEFAULT_EEPROM_DISPLACEMENT);
-            memStore(0);
+            // apply the result and store only its pages, in both the user
+            // and the default memory
+            c_mem.max_stiffness = g_mem.max_stiffness;
+            memcpy(c_mem.spring_map, g_mem.spring_map, sizeof(c_mem.spring_map));
+            stiffLutSetup();
 
-            calibration_flag = STOP;
+            memStoreMark((uint8 *)&c_mem.max_stiffness, sizeof(c_mem.max_stiffness));
+            memStoreMark((uint8 *)c_mem.spring_map, sizeof(c_mem.spring_map));
+
+            calibration_flag = STORE;
+            break;
+
+        case STORE:
+            // one page at a time, written while the loop runs
+            switch(memStoreStep()) {
+                case STORE_PENDING:
+                    break;
+
+                case STORE_FAILED:
+                    g_calib.failed = TRUE;
+                default:
+                    calibration_flag = STOP;
+                    break;
+            }
+            break;
+
+        case ABORT:
+            // motors deactivated by the host, nothing is stored
+            c_mem.k_p = old_k_p;
+            c_mem.k_i = old_k_i;
+            c_mem.k_d = old_k_d;
+            control_setup();
 
-            ISR_RS485_RX_Enable();
+            pause_counter = 0;
+            g_calib.failed = TRUE;
+            calibration_flag = STOP;
             break;
 
         case STOP:
@@ -1108,25 +2477,78 @@ void calibration()
     }
 }
 
+//==============================================================================
+//                                                              SPRING MAP BUILD
+//==============================================================================
+// Resample the calibration steps on SPRING_MAP_SIZE pretensions evenly
+// spaced from 0 to max_stiffness, by linear interpolation. Torque is held
+// beyond the recorded pretensions.
+//==============================================================================
+
+static void spring_map_build(void) {
+
+    uint8 CYDATA k;
+    uint8 CYDATA j = 0;
+    int32 CYDATA pre;
+    int32 CYDATA span;
+
+    for (k = 0; k < SPRING_MAP_SIZE; k++) {
+
+        pre = ((int32)g_mem.max_stiffness * k) / (SPRING_MAP_SIZE - 1);
+
+        while ((j < g_calib.steps - 1) && (calib_pre[j + 1] <= pre))
+            j++;
+
+        span = (j < g_calib.steps - 1) ? calib_pre[j + 1] - calib_pre[j] : 0;
+
+        if ((pre <= calib_pre[j]) || (span <= 0))
+            g_mem.spring_map[k] = calib_torque[j];
+        else
+            g_mem.spring_map[k] = calib_torque[j] + (((int32)calib_torque[j + 1] - calib_torque[j]) * (pre - calib_pre[j])) / span;
+    }
+}
+
 
 //==============================================================================
 //                                                              PWM_LIMIT_SEARCH
 //==============================================================================
 
+// PWM limit linearly interpolated on hitech_pwm_preload_values, which has a
+// point every 512 mV, so that the motors voltage does not step while the
+// supply changes. Motors are cut off above PWM_CUTOFF_TENSION, with hysteresis.
+
 void pwm_limit_search() {
     
     uint8 CYDATA index;
+    int32 CYDATA limit;                     // PWM limit, Q8
+    int32 CYDATA frac;
+    static CYBIT cut_off = FALSE;
+
+    if (dev_tension > PWM_CUTOFF_TENSION)
+        cut_off = TRUE;
+    else {
+        if (dev_tension < (PWM_CUTOFF_TENSION - PWM_CUTOFF_HYST))
+            cut_off = FALSE;
+    }
 
-    if (dev_tension > 25500)    // Max value 
-        dev_pwm_limit = 0;
+    if (cut_off)
+        limit = 0;
     else{ 
-        if (dev_tension < 8000) // Min value
-            dev_pwm_limit = 100;
+        if (dev_tension < PWM_LIMIT_MIN_TENSION)
+            limit = (int32)PWM_MAX_VALUE << 8;
         else {                  
-            index = (uint8)((dev_tension - 8000) >> 9);
-            dev_pwm_limit = hitech_pwm_preload_values[index];
+            index = (uint8)((dev_tension - PWM_LIMIT_MIN_TENSION) >> 9);
+            frac = (dev_tension - PWM_LIMIT_MIN_TENSION) & 0x1FF;
+
+            limit = ((int32)hitech_pwm_preload_values[index] << 8) +
+                ((((int32)hitech_pwm_preload_values[index + 1] - hitech_pwm_preload_values[index]) * frac) >> 1);
         }
     }
+
+    dev_pwm_limit = (uint8)(limit >> 8);
+
+    // output stage scale
+    pwm_scale = (limit * PWM_SCALE_LIMIT) >> 10;
 }
 
 
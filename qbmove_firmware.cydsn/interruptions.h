@@ -57,16 +57,29 @@ CY_ISR_PROTO(ISR_WATCHDOG_Handler);
 //=====================================================     function declaration
 
 void function_scheduler(void);
+void scheduler_timing(void);
+void comm_service(void);
+void control_setup(void);
+
+void traj_push(const int32 *, const uint16, const uint8);
+void traj_flush(void);
+uint8 friction_ident_start(void);
+void friction_ident_abort(void);
+uint8 autotune_start(const uint8);
+uint8 fra_start(const uint8, const uint8, const uint8, const uint16, const uint16, const int32);
 
 void encoder_reading(const uint8);
-void motor_control(const uint8);
 void analog_read_end();
 
 void calibration(void);
 
 void pwm_limit_search();
 
-void interrupt_manager();
+void interrupt_manager(const uint32);
+
+//=====================================================        global variables
+
+extern struct st_task tasks[NUM_OF_TASKS];
 
 // ----------------------------------------------------------------------------
 #endif
@@ -77,11 +77,6 @@ int main() {
     
     // Iterator
     uint8 i;         
-    
-    // Variable declarations for DMA 
-    
-    uint8 DMA_Chan;
-    uint8 DMA_TD[1];
 
     //================================     initializations - psoc and components
 
@@ -115,6 +110,7 @@ int main() {
     // PWM
 
     PWM_MOTORS_Start();
+    PWM_MOTORS_WritePeriod(PWM_PERIOD);
     PWM_MOTORS_WriteCompare1(0);
     PWM_MOTORS_WriteCompare2(0);
     MOTOR_DIR_Write(0);
@@ -136,13 +132,15 @@ int main() {
     // ADC
 
     ADC_Start();                                        // start ADC
-    ADC_SOC_Write(0x01);                                // Force first read cycle
    
-    // DMA
+    // DMA, conversions start from the scheduler once it is enabled
     DMA_Chan = DMA_DmaInitialize(DMA_BYTES_PER_BURST, DMA_REQUEST_PER_BURST, HI16(DMA_SRC_BASE), HI16(DMA_DST_BASE));
-    DMA_TD[0] = CyDmaTdAllocate();                                                                          // Allocate TD
-    CyDmaTdSetConfiguration(DMA_TD[0], 2 * 3, DMA_TD[0], TD_SWAP_EN | DMA__TD_TERMOUT_EN | TD_INC_DST_ADR); // DMA Configurations
-    CyDmaTdSetAddress(DMA_TD[0], LO16((uint32)ADC_DEC_SAMP_PTR), LO16((uint32)ADC_buf));                    // Set Register Address
+    DMA_TD[0] = CyDmaTdAllocate();                                                                          // Allocate TDs, one for each buffer
+    DMA_TD[1] = CyDmaTdAllocate();
+    CyDmaTdSetConfiguration(DMA_TD[0], 2 * ADC_CHANNELS * ADC_OVERSAMPLING, DMA_TD[1], TD_SWAP_EN | DMA__TD_TERMOUT_EN | TD_INC_DST_ADR); // DMA Configurations, chained in a ring
+    CyDmaTdSetConfiguration(DMA_TD[1], 2 * ADC_CHANNELS * ADC_OVERSAMPLING, DMA_TD[0], TD_SWAP_EN | DMA__TD_TERMOUT_EN | TD_INC_DST_ADR);
+    CyDmaTdSetAddress(DMA_TD[0], LO16((uint32)ADC_DEC_SAMP_PTR), LO16((uint32)ADC_buf[0]));                 // Set Register Address
+    CyDmaTdSetAddress(DMA_TD[1], LO16((uint32)ADC_DEC_SAMP_PTR), LO16((uint32)ADC_buf[1]));
     CyDmaChSetInitialTd(DMA_Chan, DMA_TD[0]);                                                               // Initialize Channel
     
     CyDmaChEnable(DMA_Chan, 1);                                                                             // Enable DMA
@@ -153,6 +151,7 @@ int main() {
 
     MY_TIMER_Start();           
     PACER_TIMER_Start();
+    control_setup();                                    // apply main frequency
 
     CYGlobalIntEnable;                                  // enable interrupts
 
@@ -170,17 +169,17 @@ int main() {
         g_meas.rot[i] = 0;
     }
    
-    g_refNew = g_ref;                                   // Initialize k+1 measurements structure
-
     g_ref.onoff = c_mem.activ;                          // Initalize Activation
 
+    g_refNew = g_ref;                                   // Initialize k+1 measurements structure
+
     //------------------------------------------------- Initialize packge on receive from RS485
     g_rx.length = 0;
     g_rx.ready  = 0;
 
 
-    MOTOR_ON_OFF_Write(g_ref.onoff);                    // Activating motors
-
+    // Motors are activated after the current offsets calibration
+    activ_pending = TRUE;
     
     dev_pwm_limit = 0;                                  // Init PWM limit
     tension_valid = FALSE;                              // Init tension_valid BIT
@@ -205,6 +204,9 @@ int main() {
         // Call function scheduler
         function_scheduler();
 
+        // Update scheduler time limits with last cycle length
+        scheduler_timing();
+
         //  Wait until the FF is set to 1
         while(FF_STATUS_Read() == 0){
             // On interrupt from RS485
@@ -215,7 +217,7 @@ int main() {
                 interrupt_flag = FALSE;
                 watchdog_flag = FALSE;
                 // Manage Interrupt on rs485
-                interrupt_manager();
+                interrupt_manager(comm_deadline);
             }
             // On interrupt from WDT
             else { 
@@ -228,6 +230,9 @@ int main() {
             }
         };
 
+        // Measure cycle length
+        timer_cycle = MY_TIMER_START - (uint32)MY_TIMER_ReadCounter();
+
         // Command a FF reset
         RESET_FF_Write(0x01);
 
@@ -46,66 +46,202 @@
 #include <math.h>
 
 //==============================================================================
-//                                                               CURRENT FILTERS
+//                                                                   FILTER BANK
+//==============================================================================
+// One state for each filter channel, configuration shared by channel group
+// and stored in c_mem.filter[]:
+// - FILTER_IIR: first order low pass, coef[0] = alpha in Q10 at 1 kHz, scaled
+//   with the main frequency. Output is kept with 6 extra bits of resolution.
+// - FILTER_BIQUAD: direct form I, coef[] = b0 b1 b2 a1 a2 in Q14, designed for
+//   the actual main frequency. Inputs must be lower than 2^14 in module.
+// - FILTER_NONE: output equals input.
+// Truncation errors are fed back to the next sample: without it a low alpha
+// stops short of rising steps, up to 2^(10 + rate_shift) / (64 * alpha)
+// counts, and biquad poles close to 1 (cutoff below ~fs/50) amplify them
+// into a large offset. tests/test_filter.c checks the step responses.
+// Channel state is cleared when the filter type changes.
 //==============================================================================
 
-int32 filter_i1(int32 new_value) {
-
-    static int32 old_value, aux;
-
-    aux = (old_value * (1024 - ALPHA) + (new_value << 6) * (ALPHA)) >> 10;
-
-    old_value = aux;
-
-    return (aux >> 6);
+CYCODE uint8 filter_group[NUM_OF_FILTERS] = {   FILTER_GROUP_CURR,       // FILTER_CURR_1
+                                                FILTER_GROUP_CURR,       // FILTER_CURR_2
+                                                FILTER_GROUP_CURR_LOOP,  // FILTER_CURR_LOOP_1
+                                                FILTER_GROUP_CURR_LOOP,  // FILTER_CURR_LOOP_2
+                                                FILTER_GROUP_VEL,        // FILTER_VEL_1
+                                                FILTER_GROUP_VEL,        // FILTER_VEL_2
+                                                FILTER_GROUP_VEL};       // FILTER_VEL_3
+
+static int32 filter_state[NUM_OF_FILTERS][5];      // IIR: y err; biquad: x1 x2 y1 y2 err
+static uint8 filter_type[NUM_OF_FILTERS];
+
+int32 filter(const uint8 ch, const int32 value) {
+
+    int32 *state = filter_state[ch];
+    int16 *coef = c_mem.filter[filter_group[ch]].coef;
+    uint8 CYDATA type = c_mem.filter[filter_group[ch]].type;
+    int32 CYDATA out;
+
+    if (type != filter_type[ch]) {
+        filter_type[ch] = type;
+        state[0] = (type == FILTER_IIR) ? (value << 6) : value;
+        state[1] = value;
+        state[2] = value;
+        state[3] = value;
+        state[4] = 0;
+    }
+
+    switch(type) {
+        case FILTER_IIR:
+            out = ((value << 6) - state[0]) * coef[0] + state[4];
+            state[4] = out & ((1L << (10 + rate_shift)) - 1);
+            state[0] += out >> (10 + rate_shift);
+
+            return (state[0] >> 6);
+
+        case FILTER_BIQUAD:
+            out = (((int32)coef[0] * value) >> 2) 
+                + (((int32)coef[1] * state[0]) >> 2)
+                + (((int32)coef[2] * state[1]) >> 2)
+                - (((int32)coef[3] * state[2]) >> 2)
+                - (((int32)coef[4] * state[3]) >> 2)
+                + state[4];
+            state[4] = out & 0x0FFF;
+            out >>= 12;
+
+            state[1] = state[0];
+            state[0] = value;
+            state[3] = state[2];
+            state[2] = out;
+
+            return out;
+
+        default:
+            return value;
+    }
 }
 
-int32 filter_i2(int32 new_value) {
 
-    static int32 old_value, aux;
+//==============================================================================
+//                                                             Q15 MULTIPLICATION
+//==============================================================================
 
-    aux = (old_value * (1024 - ALPHA) + (new_value << 6) * (ALPHA)) >> 10;
+// Returns x * q / 32768, with q in [-32768, 32768], without overflowing
+// 32 bits for any x
 
-    old_value = aux;
+int32 mul_q15(int32 x, int32 q) {
 
-    return (aux >> 6);
+    return (x >> 15) * q + (((x & 0x7FFF) * q) >> 15);
 }
 
 //==============================================================================
-//                                                              VELOCITY FILTERS
+//                                                          FIXED POINT LIBRARY
+//==============================================================================
+// Saturating operations on int32 fixed point values, in any Q format. All of
+// them saturate to [FXP_MIN, FXP_MAX] instead of wrapping; FXP_MIN is
+// -FXP_MAX so that results are symmetric. Multiplications round towards zero.
 //==============================================================================
 
-int32 filter_vel_1(int32 new_value) {
+// Returns (a * b) >> shift, with shift in [0, 31], computed on the 64 bit
+// product split in 16 bit multiplications. Partial products of zero upper
+// halves are skipped: one 32 bit multiplication if both magnitudes are below
+// 2^16, two if one of them is, four otherwise. Where the ranges of a and b
+// are known to keep the product within 32 bits, a plain multiplication is
+// cheaper still.
+
+int32 fxp_mul(int32 a, int32 b, uint8 shift) {
+
+    uint32 CYDATA ua;
+    uint32 CYDATA ub;
+    uint32 CYDATA lo;
+    uint32 CYDATA hi;
+    uint32 CYDATA mid;
+    uint32 CYDATA aux;
+    CYBIT negative = ((a < 0) != (b < 0));
+
+    ua = (a < 0) ? -(uint32)a : (uint32)a;
+    ub = (b < 0) ? -(uint32)b : (uint32)b;
+
+    // ub is the short operand, if any
+    if (ub >> 16) {
+        aux = ua;
+        ua  = ub;
+        ub  = aux;
+    }
+
+    // 64 bit product of magnitudes in hi:lo
+    lo = (ua & 0xFFFF) * (ub & 0xFFFF);
+
+    if (ub >> 16) {
+        hi  = (ua >> 16) * (ub >> 16);
+        mid = (ua >> 16) * (ub & 0xFFFF);
+        aux = (ua & 0xFFFF) * (ub >> 16);
+
+        mid += aux;
+        if (mid < aux)
+            hi += 0x10000;                  // carry of mid sum
+    }
+    else {
+        hi  = 0;
+        mid = (ua >> 16) ? (ua >> 16) * ub : 0;
+    }
+
+    aux = mid << 16;
+    lo += aux;
+    if (lo < aux)
+        hi++;                               // carry of lo sum
+    hi += mid >> 16;
+
+    // shift and saturate
+    if (shift) {
+        if (hi >> shift)
+            return negative ? FXP_MIN : FXP_MAX;
+        lo = (hi << (32 - shift)) | (lo >> shift);
+    }
+    else if (hi)
+        return negative ? FXP_MIN : FXP_MAX;
+
+    if (lo > FXP_MAX)
+        return negative ? FXP_MIN : FXP_MAX;
+
+    return negative ? -(int32)lo : (int32)lo;
+}
 
-    static int32 old_value, aux;
+// Returns a + b
 
-    aux = (old_value * (1024 - BETA) + (new_value << 6) * (BETA)) / 1024;
+int32 fxp_add(int32 a, int32 b) {
 
-    old_value = aux;
+    int32 CYDATA sum = (int32)((uint32)a + (uint32)b);
 
-    return (aux >> 6);
-}
+    // overflow when operands have the same sign and the sum has not
+    if (((a ^ sum) & (b ^ sum)) < 0)
+        return (a < 0) ? FXP_MIN : FXP_MAX;
 
-int32 filter_vel_2(int32 new_value) {
+    // 0x80000000 is out of the symmetric range
+    return (sum < FXP_MIN) ? FXP_MIN : sum;
+}
 
-    static int32 old_value, aux;
+// Returns a << shift, with shift in [0, 31]
 
-    aux = (old_value * (1024 - BETA) + (new_value << 6) * (BETA)) / 1024;
+int32 fxp_shl(int32 a, uint8 shift) {
 
-    old_value = aux;
+    if (a > (FXP_MAX >> shift))
+        return FXP_MAX;
+    if (a < -(FXP_MAX >> shift))
+        return FXP_MIN;
 
-    return (aux >> 6);
+    return a << shift;
 }
 
-int32 filter_vel_3(int32 new_value) {
+// Returns the largest |b| for which a * b fits in [FXP_MIN, FXP_MAX], to be
+// computed once for a constant a and used with FXP_MUL_LIM
 
-    static int32 old_value, aux;
+int32 fxp_lim(int32 a) {
 
-    aux = (old_value * (1024 - BETA) + (new_value << 6) * (BETA)) / 1024;
+    uint32 CYDATA ua = (a < 0) ? -(uint32)a : (uint32)a;
 
-    old_value = aux;
+    if (ua <= 1)
+        return FXP_MAX;
 
-    return (aux >> 6);
+    return (int32)((uint32)FXP_MAX / ua);
 }
 
 
@@ -50,21 +50,36 @@
 
 //--------------------------------------------------------------     DEFINITIONS
 
-#define ALPHA 3     // current filters
-#define BETA  300   // velocity filters
-    
 //#define SIGN(A) (((A) > 0) ? (1) : ((((A) < 0) ? (-1) : (0))))
 
 #define SIGN(A) (((A) >= 0) ? (1) : (-1))
 
+// Fixed point, see fxp_* functions
+#define FXP_MAX         0x7FFFFFFFL         // saturation limits, symmetric
+#define FXP_MIN         (-FXP_MAX)
+
+#define FXP_SAT(X, L)   (((X) > (L)) ? (L) : (((X) < -(L)) ? -(L) : (X)))
+#define FXP_MAC(ACC, A, B, S)   fxp_add((ACC), fxp_mul((A), (B), (S)))
+
+// (A * B) >> S as one plain multiplication while |B| <= L, L = fxp_lim(A),
+// through fxp_mul() beyond it. The plain product rounds towards minus
+// infinity. B is evaluated more than once.
+#define FXP_MUL_LIM(A, B, L, S) ((((B) <= (L)) && ((B) >= -(L))) ? (((A) * (B)) >> (S)) : fxp_mul((A), (B), (S)))
+#define FXP_MAC_LIM(ACC, A, B, L, S)    fxp_add((ACC), FXP_MUL_LIM((A), (B), (L), (S)))
+
 //-------------------------------------------------------------     DECLARATIONS
 
-int32 filter_i1(int32 value);
-int32 filter_i2(int32 value);
+int32 filter(const uint8 ch, const int32 value);
+
+int32 mul_q15(int32 x, int32 q);
+
+int32 fxp_mul(int32 a, int32 b, uint8 shift);
+
+int32 fxp_add(int32 a, int32 b);
+
+int32 fxp_shl(int32 a, uint8 shift);
 
-int32 filter_vel_1(int32 value);
-int32 filter_vel_2(int32 value);
-int32 filter_vel_3(int32 value);
+int32 fxp_lim(int32 a);
 
 uint8 LCRChecksum(uint8 *data_array, uint8 data_length);
 
@@ -0,0 +1,233 @@
+/**
+* \file         bench_control.c
+*
+* \brief        Host benchmark of the position loop, one control cycle on
+*               both motors, P, I and D active, from the errors to the PWM
+*               compare values:
+*
+*               - base: the arithmetic of motor_control() in CONTROL_ANGLE
+*                 before the control kernels, plain multiplications and the
+*                 division of the pwm_limit remap.
+*               - fxp:  ctrl_position() and ctrl_output() with every gain
+*                 product through fxp_mul().
+*               - lim:  ctrl_position() and ctrl_output() as they are, gain
+*                 products through FXP_MUL_LIM.
+*
+*               The loops are transcribed from interruptions.c, the fixed
+*               point library is the firmware one. For each variant it
+*               prints the 32 bit multiplications and divisions per cycle,
+*               which are library calls on the 8051 and the bulk of the
+*               cycle there, and the host time per cycle. Host times do
+*               not carry over to the target: the host divides and
+*               multiplies in a few clocks and pays for the mispredicted
+*               branches of the saturations, the 8051 has no branch
+*               prediction and a division costs many times a
+*               multiplication. The counts do carry over.
+*
+*               Errors are spread over 2^0..2^18 ticks, velocities over
+*               2^0..2^12 ticks/ms, integral sums over the whole limit.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "utils.h"
+
+// Firmware globals used by utils.c
+struct st_mem c_mem;
+uint8 rate_shift;
+
+#define SAMPLES     4096
+#define RUNS        2000
+
+// Output stage scale as in interruptions.c
+#if PWM_PERIOD < 128
+#define PWM_SCALE_SHIFT 24
+#elif PWM_PERIOD < 2048
+#define PWM_SCALE_SHIFT 20
+#else
+#define PWM_SCALE_SHIFT 14
+#endif
+#define PWM_SCALE_LIMIT ((((int32)PWM_PERIOD << (PWM_SCALE_SHIFT + 2 - PWM_OUT_SHIFT)) + (int32)PWM_MAX_VALUE * PWM_MAX_VALUE - 1) / ((int32)PWM_MAX_VALUE * PWM_MAX_VALUE))
+
+#define PWM_LIMIT   80              // dev_pwm_limit at 10 V
+#define DEADBAND    (2 << PWM_OUT_SHIFT)
+
+static const int32 k_p = 0.1 * 65536;
+static const int32 k_i = 0.01 * 65536;
+static const int32 k_d = 0.8 * 65536;
+static const int32 pos_sat = POS_INTEGRAL_SAT_LIMIT;
+
+static int32 lim_p, lim_i, lim_d;
+static int32 pwm_scale;
+
+static int32 err[SAMPLES][NUM_OF_MOTORS];
+static int32 sum[SAMPLES][NUM_OF_MOTORS];
+static int32 vel[SAMPLES][NUM_OF_MOTORS];
+
+static volatile int32 sink;
+
+// PWM_MAX_VALUE read at run time: C51 calls the 32 bit division of the
+// library on a constant divisor too, where the host compiler would turn it
+// into a multiplication
+static volatile int32 pwm_max_value = PWM_MAX_VALUE;
+
+// Random value of random magnitude, below 2^bits
+static int32 rnd_spread(int bits) {
+
+    int32 v = (((int32)(rand() & 0x7FFF) << 16) | (rand() & 0xFFFF)) >> (31 - bits + rand() % (bits + 1));
+
+    return (rand() & 1) ? -v : v;
+}
+
+//==============================================================================
+//                                                                      VARIANTS
+//==============================================================================
+
+static int32 output_base(int32 pwm_input) {
+
+    if (pwm_input > PWM_MAX_VALUE)
+        pwm_input = PWM_MAX_VALUE;
+    if (pwm_input < -PWM_MAX_VALUE)
+        pwm_input = -PWM_MAX_VALUE;
+
+    return (((pwm_input << 10) / pwm_max_value) * PWM_LIMIT) >> 10;
+}
+
+static int32 output_kernel(int32 pwm_out) {
+
+    if (pwm_out > 0)
+        pwm_out = fxp_add(pwm_out, DEADBAND);
+    if (pwm_out < 0)
+        pwm_out = fxp_add(pwm_out, -(int32)DEADBAND);
+
+    pwm_out = FXP_SAT(pwm_out, (int32)PWM_MAX_VALUE << PWM_OUT_SHIFT);
+    pwm_out = (pwm_out * pwm_scale) >> PWM_SCALE_SHIFT;
+
+    return FXP_SAT(pwm_out, PWM_PERIOD);
+}
+
+static void cycle_base(int n) {
+
+    int i;
+    int32 e, s, pwm_input;
+
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+        e = err[n][i];
+        s = sum[n][i];
+
+        if ((e > 131072) || (e < -131072))
+            pwm_input = (k_p * (e >> 8)) >> 8;
+        else
+            pwm_input = (k_p * e) >> 16;
+        pwm_input += ((k_i >> 6) * s) >> 10;
+        pwm_input += (k_d * -vel[n][i]) >> 16;
+
+        sink = output_base(pwm_input);
+    }
+}
+
+static void cycle_fxp(int n) {
+
+    int i;
+    int32 pwm_input;
+
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+        pwm_input = fxp_mul(k_p, err[n][i], 16 - PWM_OUT_SHIFT);
+        pwm_input = FXP_MAC(pwm_input, k_i, sum[n][i], 16 - PWM_OUT_SHIFT);
+        pwm_input = FXP_MAC(pwm_input, -k_d, vel[n][i], 16 - PWM_OUT_SHIFT);
+
+        sink = output_kernel(pwm_input);
+    }
+}
+
+static void cycle_lim(int n) {
+
+    int i;
+    int32 pwm_input;
+
+    for (i = 0; i < NUM_OF_MOTORS; i++) {
+        pwm_input = FXP_MUL_LIM(k_p, err[n][i], lim_p, 16 - PWM_OUT_SHIFT);
+        pwm_input = FXP_MAC_LIM(pwm_input, k_i, sum[n][i], lim_i, 16 - PWM_OUT_SHIFT);
+        pwm_input = FXP_MAC_LIM(pwm_input, -k_d, vel[n][i], lim_d, 16 - PWM_OUT_SHIFT);
+
+        sink = output_kernel(pwm_input);
+    }
+}
+
+//==============================================================================
+//                                                             OPERATION COUNTS
+//==============================================================================
+
+// 32 bit multiplications of fxp_mul(), see utils.c
+static int ops_fxp_mul(int32 a, int32 b) {
+
+    uint32 ua = (a < 0) ? -(uint32)a : (uint32)a;
+    uint32 ub = (b < 0) ? -(uint32)b : (uint32)b;
+
+    if ((ua >> 16) && (ub >> 16))
+        return 4;
+    if ((ua >> 16) || (ub >> 16))
+        return 2;
+    return 1;
+}
+
+static int ops_lim_mul(int32 a, int32 b, int32 lim) {
+
+    return ((b <= lim) && (b >= -lim)) ? 1 : ops_fxp_mul(a, b);
+}
+
+//==============================================================================
+//                                                                          MAIN
+//==============================================================================
+
+static double bench(void (*cycle)(int)) {
+
+    clock_t t0;
+    int n, r;
+
+    t0 = clock();
+    for (r = 0; r < RUNS; r++)
+        for (n = 0; n < SAMPLES; n++)
+            cycle(n);
+
+    return (clock() - t0) * (1e9 / CLOCKS_PER_SEC) / ((double)RUNS * SAMPLES);
+}
+
+int main(void) {
+
+    int n, i;
+    long mul_fxp = 0, mul_lim = 0;
+    double ns_base, ns_fxp, ns_lim;
+
+    lim_p = fxp_lim(k_p);
+    lim_i = fxp_lim(k_i);
+    lim_d = fxp_lim(k_d);
+    pwm_scale = ((int32)PWM_LIMIT * PWM_SCALE_LIMIT) >> 10;
+
+    srand(1);
+    for (n = 0; n < SAMPLES; n++) {
+        for (i = 0; i < NUM_OF_MOTORS; i++) {
+            err[n][i] = rnd_spread(18);
+            sum[n][i] = rnd_spread(17) % (pos_sat + 1);
+            vel[n][i] = rnd_spread(12);
+
+            mul_fxp += ops_fxp_mul(k_p, err[n][i]) + ops_fxp_mul(k_i, sum[n][i]) + ops_fxp_mul(k_d, vel[n][i]) + 1;
+            mul_lim += ops_lim_mul(k_p, err[n][i], lim_p) + ops_lim_mul(k_i, sum[n][i], lim_i) + ops_lim_mul(k_d, vel[n][i], lim_d) + 1;
+        }
+    }
+
+    ns_base = bench(cycle_base);
+    ns_fxp = bench(cycle_fxp);
+    ns_lim = bench(cycle_lim);
+
+    printf("bench_control: per cycle, %d motors, P I D\n", NUM_OF_MOTORS);
+    printf("  base  %5.2f mul  %4.2f div  %6.2f ns\n", 4.0 * NUM_OF_MOTORS, 1.0 * NUM_OF_MOTORS, ns_base);
+    printf("  fxp   %5.2f mul  %4.2f div  %6.2f ns\n", (double)mul_fxp / SAMPLES, 0.0, ns_fxp);
+    printf("  lim   %5.2f mul  %4.2f div  %6.2f ns\n", (double)mul_lim / SAMPLES, 0.0, ns_lim);
+
+    return EXIT_SUCCESS;
+}
+
+/* [] END OF FILE */
@@ -0,0 +1,32 @@
+/**
+* \file         device.h
+*
+* \brief        Host build stand-in for the PSoC Creator generated device.h.
+*               Only the types and qualifiers used by the firmware sources
+*               compiled by the host tests are defined.
+*/
+
+#ifndef DEVICE_H_INCLUDED
+#define DEVICE_H_INCLUDED
+
+#include <stdint.h>
+#include <string.h>
+
+typedef uint8_t     uint8;
+typedef int8_t      int8;
+typedef uint16_t    uint16;
+typedef int16_t     int16;
+typedef uint32_t    uint32;
+typedef int32_t     int32;
+
+typedef uint8_t     CYBIT;
+typedef volatile uint8_t reg8;
+
+#define CYDATA
+#define CYIDATA
+#define CYXDATA
+#define CYCODE      const
+
+#endif
+
+/* [] END OF FILE */
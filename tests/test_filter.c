@@ -0,0 +1,189 @@
+/**
+* \file         test_filter.c
+*
+* \brief        Host tests of the filter bank in utils.c: step responses of
+*               every filter type against a float reference.
+*
+*               - FILTER_IIR: y += alpha / 1024 * (x - y), alpha scaled with
+*                 the main frequency, within IIR_TOL counts and settling on
+*                 the step value.
+*               - FILTER_BIQUAD: Butterworth low pass, direct form I on the
+*                 same Q14 coefficients. The error grows as the poles get
+*                 close to 1, the tolerance is BIQUAD_TOL counts plus 1/32
+*                 of the filter gain on the truncations, 2^14 / (2^14 + a1 +
+*                 a2). Cutoffs go from fs/200, below it Q14 coefficients
+*                 are too coarse.
+*               - FILTER_NONE: output equals input.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <math.h>
+
+#include "utils.h"
+
+#ifndef M_PI
+#define M_PI    3.14159265358979323846
+#endif
+#ifndef M_SQRT2
+#define M_SQRT2 1.41421356237309504880
+#endif
+
+// Firmware globals used by utils.c
+struct st_mem c_mem;
+uint8 rate_shift;
+
+#define IIR_TOL         2           // counts
+#define BIQUAD_TOL      2           // counts
+#define BIQUAD_SAMPLES  20000
+
+static long failures;
+
+static void set_filter(uint8 group, uint8 type, const int16 *coef) {
+
+    uint8 i;
+
+    c_mem.filter[group].type = type;
+    for (i = 0; i < 5; i++)
+        c_mem.filter[group].coef[i] = coef ? coef[i] : 0;
+}
+
+// Initial value, then a step to amp for 20 time constants; returns the max
+// error on the reference
+static double iir_step(uint8 ch, int16 alpha, int32 amp, double *final_err) {
+
+    double y = 0;
+    double k = alpha / (1024.0 * (1 << rate_shift));
+    double err, max_err = 0;
+    int32 out = 0;
+    long n;
+
+    filter(ch, 0);
+
+    for (n = 0; n < ((20480L / alpha + 16) << rate_shift); n++) {
+        y += k * (amp - y);
+        out = filter(ch, amp);
+        err = fabs(out - y);
+        if (err > max_err)
+            max_err = err;
+    }
+
+    *final_err = fabs(out - (double)amp);
+    return max_err;
+}
+
+static void test_iir(uint8 group, uint8 ch, int16 alpha, int32 amp) {
+
+    int16 coef[5] = {0};
+    double max_err, final_err;
+
+    coef[0] = alpha;
+
+    // state cleared by a type change
+    set_filter(group, FILTER_NONE, NULL);
+    filter(ch, 0);
+    set_filter(group, FILTER_IIR, coef);
+
+    max_err = iir_step(ch, alpha, amp, &final_err);
+
+    if ((max_err > IIR_TOL) || (final_err > 1)) {
+        if (failures++ < 10)
+            printf("IIR alpha %d rate_shift %u step %ld: max error %.2f, final %.2f\n",
+                alpha, rate_shift, (long)amp, max_err, final_err);
+    }
+}
+
+// Second order Butterworth low pass, cutoff fc at sampling fs, Q14
+static void butterworth(double fc, double fs, int16 *coef) {
+
+    double w = tan(M_PI * fc / fs);
+    double n = 1.0 / (1.0 + M_SQRT2 * w + w * w);
+
+    coef[0] = (int16)lround(16384.0 * w * w * n);
+    coef[1] = (int16)lround(16384.0 * 2.0 * w * w * n);
+    coef[2] = coef[0];
+    coef[3] = (int16)lround(16384.0 * 2.0 * (w * w - 1.0) * n);
+    coef[4] = (int16)lround(16384.0 * (1.0 - M_SQRT2 * w + w * w) * n);
+}
+
+static void test_biquad(uint8 group, uint8 ch, double fc_ratio, int32 amp) {
+
+    int16 coef[5];
+    double b0, b1, b2, a1, a2;
+    double x1 = 0, x2 = 0, y = 0, y1 = 0, y2 = 0;
+    double err, max_err = 0, tol;
+    int32 out = 0;
+    long n;
+
+    butterworth(fc_ratio, 1.0, coef);
+    tol = BIQUAD_TOL + 16384.0 / (16384.0 + coef[3] + coef[4]) / 32;
+    b0 = coef[0] / 16384.0;
+    b1 = coef[1] / 16384.0;
+    b2 = coef[2] / 16384.0;
+    a1 = coef[3] / 16384.0;
+    a2 = coef[4] / 16384.0;
+
+    set_filter(group, FILTER_NONE, NULL);
+    filter(ch, 0);
+    set_filter(group, FILTER_BIQUAD, coef);
+    filter(ch, 0);
+
+    for (n = 0; n < BIQUAD_SAMPLES; n++) {
+        y = b0 * amp + b1 * x1 + b2 * x2 - a1 * y1 - a2 * y2;
+        x2 = x1;
+        x1 = amp;
+        y2 = y1;
+        y1 = y;
+
+        out = filter(ch, amp);
+        err = fabs(out - y);
+        if (err > max_err)
+            max_err = err;
+    }
+
+    if (max_err > tol) {
+        if (failures++ < 10)
+            printf("biquad fc fs/%.0f step %ld: max error %.2f, tolerance %.2f\n",
+                1.0 / fc_ratio, (long)amp, max_err, tol);
+    }
+}
+
+static void test_none(uint8 group, uint8 ch) {
+
+    int32 x;
+
+    set_filter(group, FILTER_NONE, NULL);
+    for (x = -100000; x <= 100000; x += 77) {
+        if ((filter(ch, x) != x) && (failures++ < 10))
+            printf("none: %ld -> %ld\n", (long)x, (long)filter(ch, x));
+    }
+}
+
+int main(void) {
+
+    static const int16 alpha[] = {1, 3, 16, 300, 512, 1024};
+    static const int32 amp[] = {1, 100, 1500, -1500, 8191, -8191, 32767, -32767};
+    static const double fc[] = {1.0 / 200, 1.0 / 50, 1.0 / 20, 1.0 / 5};
+    uint8 a, s, f;
+
+    for (rate_shift = 0; rate_shift <= 2; rate_shift++) {
+
+        for (a = 0; a < sizeof(alpha) / sizeof(alpha[0]); a++)
+            for (s = 0; s < sizeof(amp) / sizeof(amp[0]); s++)
+                test_iir(FILTER_GROUP_CURR, FILTER_CURR_1, alpha[a], amp[s]);
+
+        test_none(FILTER_GROUP_CURR_LOOP, FILTER_CURR_LOOP_1);
+    }
+
+    // biquads are designed for the actual main frequency, inputs must be
+    // lower than 2^14 in module
+    for (f = 0; f < sizeof(fc) / sizeof(fc[0]); f++)
+        for (s = 0; s < sizeof(amp) / sizeof(amp[0]) - 2; s++)
+            test_biquad(FILTER_GROUP_VEL, FILTER_VEL_2, fc[f], amp[s]);
+
+    printf("test_filter: %s (%ld failures)\n", failures ? "FAILED" : "passed", failures);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* [] END OF FILE */
@@ -0,0 +1,187 @@
+/**
+* \file         test_fxp.c
+*
+* \brief        Host tests of the fixed point library in utils.c.
+*
+*               fxp_mul, fxp_add and fxp_shl are checked against a 64 bit
+*               reference, saturated to [FXP_MIN, FXP_MAX] and rounded
+*               towards zero: exhaustively on every pair of edge operands
+*               and every shift, on every 16 bit operand times the edge
+*               values, and on random operands. FXP_MUL_LIM is checked on
+*               the same operands, rounded towards minus infinity within
+*               fxp_lim() and as fxp_mul beyond it. mul_q15 is checked to be
+*               floor(x * q / 32768) for every q in [-32768, 32768].
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "utils.h"
+
+// Firmware globals used by utils.c
+struct st_mem c_mem;
+uint8 rate_shift;
+
+static const int32 edge[] = {
+    0, 1, -1, 2, -2, 3, -3, 0x7FFF, -0x7FFF, 0x8000, -0x8000, 0xFFFF,
+    -0xFFFF, 0x10000, -0x10000, 0x10001, -0x10001, 0x12345678, -0x12345678,
+    0x3FFFFFFF, -0x3FFFFFFF, 0x40000000, -0x40000000, 0x7FFFFFFF, -0x7FFFFFFF,
+    INT32_MIN
+};
+
+#define NUM_EDGE    ((int)(sizeof(edge) / sizeof(edge[0])))
+#define RANDOM_RUNS 10000000L
+
+static long failures;
+
+static int64_t sat(int64_t v) {
+
+    if (v > FXP_MAX)
+        return FXP_MAX;
+    if (v < FXP_MIN)
+        return FXP_MIN;
+    return v;
+}
+
+// 64 bit reference, rounded towards zero
+static int64_t ref_mul(int32 a, int32 b, uint8 shift) {
+
+    int64_t p = (int64_t)a * b;
+
+    return (p < 0) ? -(-p >> shift) : (p >> shift);
+}
+
+static uint32 rnd32(void) {
+
+    return ((uint32)(rand() & 0xFFFF) << 16) ^ (uint32)(rand() & 0xFFFF);
+}
+
+// Random operand, spread over all magnitudes
+static int32 rnd_operand(void) {
+
+    return (int32)rnd32() >> (rand() % 32);
+}
+
+static void check_mul(int32 a, int32 b, uint8 shift) {
+
+    int32 r = fxp_mul(a, b, shift);
+
+    if (r != sat(ref_mul(a, b, shift)) && failures++ < 10)
+        printf("fxp_mul(%ld, %ld, %u) = %ld, expected %lld\n", (long)a, (long)b,
+            shift, (long)r, (long long)sat(ref_mul(a, b, shift)));
+}
+
+static void check_mul_lim(int32 a, int32 b, uint8 shift) {
+
+    int32 lim = fxp_lim(a);
+    int32 r = FXP_MUL_LIM(a, b, lim, shift);
+    int64_t p = (int64_t)a * b;
+    int64_t e;
+
+    if (b <= lim && b >= -lim) {
+        if (p > FXP_MAX || p < FXP_MIN) {
+            if (failures++ < 10)
+                printf("fxp_lim(%ld) = %ld overflows on %ld\n", (long)a,
+                    (long)lim, (long)b);
+            return;
+        }
+        e = (p >= 0) ? (p >> shift) : -((-p + ((int64_t)1 << shift) - 1) >> shift);  // floor
+    }
+    else
+        e = sat(ref_mul(a, b, shift));
+
+    if (r != e && failures++ < 10)
+        printf("FXP_MUL_LIM(%ld, %ld, %u) = %ld, expected %lld\n", (long)a,
+            (long)b, shift, (long)r, (long long)e);
+}
+
+static void check_add(int32 a, int32 b) {
+
+    int32 r = fxp_add(a, b);
+
+    if (r != sat((int64_t)a + b) && failures++ < 10)
+        printf("fxp_add(%ld, %ld) = %ld\n", (long)a, (long)b, (long)r);
+}
+
+static void check_shl(int32 a, uint8 shift) {
+
+    int32 r;
+
+    // INT32_MIN is outside of the symmetric range of the operands
+    if (a == INT32_MIN)
+        return;
+
+    r = fxp_shl(a, shift);
+
+    if (r != sat((int64_t)a * ((int64_t)1 << shift)) && failures++ < 10)
+        printf("fxp_shl(%ld, %u) = %ld\n", (long)a, shift, (long)r);
+}
+
+static void check_mul_q15(int32 x, int32 q) {
+
+    int64_t p = (int64_t)x * q;
+    int64_t e = (p >= 0) ? (p >> 15) : -((-p + 32767) >> 15);   // floor
+
+    // Only results within 32 bits are specified
+    if (e > INT32_MAX || e < INT32_MIN)
+        return;
+
+    if (mul_q15(x, q) != e && failures++ < 10)
+        printf("mul_q15(%ld, %ld) = %ld, expected %lld\n", (long)x, (long)q,
+            (long)mul_q15(x, q), (long long)e);
+}
+
+int main(void) {
+
+    int i, j;
+    uint8 s;
+    int32 x, q;
+    long n;
+
+    // Every pair of edge operands, every shift
+    for (i = 0; i < NUM_EDGE; i++) {
+        for (j = 0; j < NUM_EDGE; j++) {
+            for (s = 0; s < 32; s++) {
+                check_mul(edge[i], edge[j], s);
+                check_mul_lim(edge[i], edge[j], s);
+                check_shl(edge[i], s);
+            }
+            check_add(edge[i], edge[j]);
+        }
+    }
+
+    // Every 16 bit operand times the edge values
+    for (x = -0x10000; x <= 0x10000; x++) {
+        for (j = 0; j < NUM_EDGE; j++) {
+            check_mul(x, edge[j], 16);
+            check_mul(edge[j], x, 8);
+            check_mul_lim(edge[j], x, 8);
+            check_mul_lim(x, edge[j], 16);
+            check_add(x << 15, edge[j]);
+        }
+    }
+
+    // Random operands
+    srand(1);
+    for (n = 0; n < RANDOM_RUNS; n++) {
+        s = rand() % 32;
+        check_mul(rnd_operand(), rnd_operand(), s);
+        check_mul_lim(rnd_operand(), rnd_operand(), s);
+        check_add(rnd_operand(), rnd_operand());
+        check_shl(rnd_operand(), s);
+    }
+
+    // mul_q15, every q on edge and random x
+    for (q = -32768; q <= 32768; q++) {
+        for (j = 0; j < NUM_EDGE; j++)
+            check_mul_q15(edge[j], q);
+        for (i = 0; i < 32; i++)
+            check_mul_q15(rnd_operand(), q);
+    }
+
+    printf("test_fxp: %s (%ld failures)\n", failures ? "FAILED" : "passed", failures);
+
+    return failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* [] END OF FILE */